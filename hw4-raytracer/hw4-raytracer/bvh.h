@@ -2,10 +2,21 @@
 
 #include <glm/glm.hpp>
 #include <vector>
+#include <unordered_map>
 #include <algorithm>
 #include <iostream>
+#include <string>
+#include <climits>
+#include <cfloat>
+#include <cmath>
+#include <chrono>
+#include <atomic>
 #include "enums.h"
 #include "ray.h"
+#include "thread_pool.h"
+#include "morton.h"
+#include "bvh_layout.h"
+#include "bvh_simd.h"
 
 template <typename T>
 class BVH;
@@ -27,65 +38,267 @@ struct BoundingBox { // axis-aligned bounding box
 		glm::vec3 s = c2 - c1; // sides: (w, h, l)
 		return 2.0f * (s.x * s.y + s.x * s.z + s.y * s.z);
 	}
+
+	// empty box that any expand() call will replace
+	static BoundingBox empty() {
+		return BoundingBox(glm::vec3(FLT_MAX), glm::vec3(-FLT_MAX));
+	}
+	void expand(const BoundingBox& b) {
+		c1 = glm::min(c1, b.c1);
+		c2 = glm::max(c2, b.c2);
+	}
+	void expand(const glm::vec3& p) {
+		c1 = glm::min(c1, p);
+		c2 = glm::max(c2, p);
+	}
+	void clip(const BoundingBox& b) { // intersection; stays empty if they don't overlap
+		c1 = glm::max(c1, b.c1);
+		c2 = glm::min(c2, b.c2);
+	}
+	bool is_empty() const {
+		return c1.x > c2.x || c1.y > c2.y || c1.z > c2.z;
+	}
 };
 
+// SAH cost model, relative to one primitive intersection test
+const float SAH_TRAVERSAL_COST = 1.0f;
+const float SAH_INTERSECT_COST = 1.0f;
+const int BVH_MAX_BINS = 32;
+const int BVH_PARALLEL_THRESHOLD = 4096; // subtrees at least this big are built as pool tasks
+const float BVH_REFIT_REBUILD_RATIO = 1.5f; // refit trees whose SAH cost grew past this factor are rebuilt (see Scene::update_bvh)
+const float SBVH_MIN_OVERLAP = 1e-5f; // spatial splits are only tried where the object split's children overlap this much (of the root area)
+const int SBVH_MAX_DEPTH = 64; // no more spatial splits below this depth
+
+// bin of a position already scaled to bin units; clamped while still a float, so the cast stays
+// defined for NaN or huge values (tiny extents) and positions just outside the bounds
+inline int bvh_bin(float x, int bins) {
+	if (!(x > 0.0f)) {
+		return 0;
+	}
+	if (x >= static_cast<float>(bins - 1)) {
+		return bins - 1;
+	}
+	return static_cast<int>(x);
+}
+
+// traversal counters: a few atomic adds per query on counters every render thread shares, so
+// they are off by default; build with BVH_STATS 1 to profile traversal
+#ifndef BVH_STATS
+#define BVH_STATS 0
+#endif
+const int BVH_STACK_SIZE = 128; // deeper trees fall back to a heap stack
+const int PACKET_SPLIT_RAYS = 2; // packets with this few rays left in a node continue as single rays
+
+struct BVHTraversalStats {
+	std::atomic<unsigned long long> queries{ 0 };
+	std::atomic<unsigned long long> nodes_visited{ 0 }; // popped and processed
+	std::atomic<unsigned long long> nodes_culled{ 0 };  // box on the ray, but entered beyond tmax (closest hit or light)
+	std::atomic<unsigned long long> nodes_missed{ 0 };  // box not on the ray at all
+	std::atomic<unsigned long long> prims_tested{ 0 };
+	std::atomic<unsigned long long> occlusion_queries{ 0 }; // any-hit queries, also counted in 'queries'
+	std::atomic<unsigned long long> occlusion_hits{ 0 };
+	std::atomic<unsigned long long> packets{ 0 };        // packet queries (their nodes are counted once per packet)
+	std::atomic<unsigned long long> packet_splits{ 0 };  // subtrees finished ray by ray after the packet diverged
+};
+
+enum BVHBuildMethod {
+	BVH_BUILD_SAH,  // top-down binned SAH: best trees
+	BVH_BUILD_LBVH, // primitives sorted by Morton code, tree from the code bits: much faster, somewhat worse trees
+};
+
+// primitives.h: typed arrays that the leaves of a BVH<PrimRef> index into. It also has the BVH's
+// primitive access (prim_object, leaf_key and the leaf tests), found through PrimRef when the
+// BVH is instantiated.
+class PrimitiveStore;
+
+// per-BVH construction settings
+struct BVHBuildOptions {
+	BVHBuildMethod method = BVH_BUILD_SAH;
+	int bins = 16;         // candidate split planes per axis are the bin borders (at most BVH_MAX_BINS)
+	int max_leaf_size = 4; // larger ranges are always split; smaller ones become a leaf where the SAH says so
+	int width = BVH_DEFAULT_WIDTH; // children per traversal node: 2 (binary), 4 or 8 (collapsed, SIMD box tests)
+	// SBVH: split space as well as objects, so a primitive can be referenced from several leaves
+	// (each with the clipped part of its box); this caps the extra references as a fraction of
+	// the primitive count. 0 builds object splits only. Trees with split references can't be
+	// edited with insert()/remove(). SAH builds only.
+	float spatial_split_budget = 0.0f;
+	BVHNodeLayout layout = BVH_LAYOUT_DEPTH_FIRST; // memory order of the binary and wide node arrays
+	bool huge_pages = false; // back big node arrays with huge pages (fewer TLB misses on deep traversals)
+	// keep only 4-wide nodes with 8-bit child boxes (QuantizedBVHNode, 64 bytes): about a fifth of
+	// the node memory of the float layouts. The tree can't be refit or edited afterwards.
+	bool quantized = false;
+};
+
+// candidate split of a node: object split (references partitioned by centroid bins) or
+// spatial split (at a plane, references crossing it go to both sides)
+struct BVHSplit {
+	float cost = FLT_MAX;
+	int axis = -1; // -1: nothing found
+	int border = 0; // bins [0, border) go left
+	bool spatial = false;
+	float plane = 0.0f; // spatial: position along 'axis'
+	BoundingBox left = BoundingBox::empty();
+	BoundingBox right = BoundingBox::empty();
+	int left_count = 0;
+	int right_count = 0;
+};
+
+// primitive as seen by the builder
+struct BuildPrim {
+	BoundingBox box;
+	glm::vec3 centroid;
+	int index; // into the object list given to the BVH
+	float cost; // of testing it, in SAH units (Object::intersect_cost)
+};
+
+// Compact node of the flattened BVH: 32 bytes, so two nodes share a cache line.
+// Nodes are stored depth-first, so an interior node's left child is the next node in the array
+// (unless another BVHNodeLayout was asked for, or BVH::insert/remove spliced nodes in wherever
+// there was a free slot).
+struct alignas(32) LinearBVHNode {
+	float bmin[3];
+	int left;  // interior: index of the left child; leaf: index of its first primitive
+	float bmax[3];
+	int right; // interior: index of the right child; leaf: -(number of primitives)
+
+	bool is_leaf() const { return right < 0; }
+	int prim_offset() const { return left; }
+	int prim_count() const { return -right; }
+	// slab test; on a hit, 'tentry' is where the ray enters the box (0 if it starts inside)
+	bool intersect(const glm::vec3& origin, const glm::vec3& inv_dir, float& tentry) const;
+};
+
+static_assert(sizeof(LinearBVHNode) == 32, "LinearBVHNode should stay 32 bytes");
+
 // Bounding Volume Hiearchies, using SAH to split
 template <typename T>
 class BVH {
 private: 
-	BVHNode<T>* root;
-	BVHNode<T>* split_nodes(BVHNode<T>* r, std::vector<BVHNode<T>*> leaf_nodes); // splits root
-
-	// Methods needed for SAH:
-	float SAH_cost(std::vector<float> cumulative_sa, int prims_on_left); // helper function for constructor
-	int* min_SAH_params(std::vector<BVHNode<T>*> temp); // returns (best split axis, split position)
-	void _display(BVHNode<T>* r);
-	Intersection _locate(BVHNode<T>* node, Ray& r);
-	// helper functions
-	glm::vec3 vec3_get_extremes(const glm::vec3& a, const glm::vec3& b, bool max) {
-		return (max) ?
-			glm::vec3(
-				std::max(a.x, b.x),
-				std::max(a.y, b.y),
-				std::max(a.z, b.z)
-			) : glm::vec3(
-				std::min(a.x, b.x),
-				std::min(a.y, b.y),
-				std::min(a.z, b.z)
-			);
-	};
-	bool centroid_sort(BoundingBox const& b1, BoundingBox const& b2, int axis) {
-		glm::vec3 center1 = (b1.c1 + b1.c2) / 2.0f;
-		glm::vec3 center2 = (b2.c1 + b2.c2) / 2.0f;
-
-		return center1[axis] < center2[axis];
-	};
+	BVHNode<T>* root = nullptr; // build-time tree, released once flattened
+	NodeArray<LinearBVHNode> nodes; // flattened tree used for traversal (root at 0)
+	std::vector<T> prims; // primitives in leaf order; leaves index into this
+	const PrimitiveStore* store = nullptr; // what PrimRef primitives index into
+	BoundingBox prim_box(const T& prim) {
+		return BoundingBox(prim_object(store, prim)->get_xyz_extrema(false), prim_object(store, prim)->get_xyz_extrema(true));
+	}
+	std::vector<BuildPrim> build_prims; // only alive during construction
+	BVHBuildOptions options;
+	double build_ms = 0.0;
+	BVHNode<T>* build_range(int begin, int end); // binned SAH over build_prims[begin, end)
+	int partition_median(int begin, int end, int axis); // fallback when all centroids share a bin
+	BVHSplit find_object_split(const BuildPrim* refs, int count, const BoundingBox& bounds, const BoundingBox& centroid_bounds);
+	// SBVH build: works on reference lists instead of ranges of build_prims, since spatial splits duplicate references
+	const std::vector<T>* build_objects = nullptr; // only alive during construction
+	// Each subtree gets its own share of the split budget (extra references it may add, what it
+	// didn't use is handed back in 'budget') and appends its leaves' references to its own list,
+	// so the tree doesn't depend on how the build tasks were scheduled.
+	float build_root_area = 0.0f;
+	int split_refs = 0; // references beyond one per primitive
+	BVHNode<T>* build_spatial(std::vector<BuildPrim>& refs, int depth, int& budget, std::vector<BuildPrim>& leaves);
+	BVHSplit find_spatial_split(const std::vector<BuildPrim>& refs, const BoundingBox& bounds);
+	BVHNode<T>* make_leaf(const std::vector<BuildPrim>& refs, const BoundingBox& bounds, std::vector<BuildPrim>& leaves);
+	void shift_leaves(BVHNode<T>* node, int offset); // first_prim of every leaf below node
+	// LBVH build: build_prims sorted by the Morton code of their centroid, each node splits its
+	// range where the highest differing code bit flips
+	std::vector<uint64_t> morton_keys; // only alive during construction, parallel to build_prims
+	BVHNode<T>* build_linear(int begin, int end);
+	int max_depth = 0; // of the flattened tree, sizes the traversal stack
+	BVHTraversalStats stats;
+	int flatten(BVHNode<T>* node, const std::vector<T>& objects, int depth); // depth-first copy into 'nodes', returns node index
+	// wide layouts, collapsed from 'nodes' when options.width asks for them (only one is filled)
+	NodeArray<WideBVHNode<4>> wide4;
+	NodeArray<WideBVHNode<8>> wide8;
+	Intersection locate_binary(Ray& ray, int start); // closest hit below node 'start' of the binary tree
+	template <int W> int collapse(NodeArray<WideBVHNode<W>>& out, int idx);
+	void reorder_nodes(); // binary nodes into options.layout (drops free slots)
+	template <typename N> void reorder_wide(NodeArray<N>& wide);
+	NodeArray<QuantizedBVHNode> wideq; // options.quantized: the only node array left after the build
+	BoundingBox quantized_bounds;
+	void quantize(); // wide4 (collapsed here if needed) -> wideq, then drops the float nodes
+	void build_wide(); // (re)collapse the binary nodes into the layout options.width asks for
+	float build_sah = 0.0f; // sah_cost() right after the build
+	void tree_order(std::vector<int>& order); // live nodes reachable from the root, parents before children
+	// incremental updates: parent links are only kept once insert()/remove() has been used
+	std::vector<int> parents; // per node, -1 for the root
+	std::vector<int> heights; // per node, levels below it (0 for a leaf): keeps max_depth exact
+	std::vector<int> free_nodes; // slots released by remove(), reused by insert()
+	std::vector<int> free_prims; // 'prims' slots released by remove(), reused by insert()
+	std::unordered_map<T, int> prim_slots; // primitive -> its index in 'prims'
+	std::vector<int> prim_leaves; // per 'prims' slot, the leaf holding it
+	void init_updates();
+	int alloc_node();
+	BoundingBox node_box(int idx);
+	void set_node_box(int idx, const BoundingBox& box);
+	void move_node(int from, int to); // copy a node to another slot and repoint its children
+	void replace_child(int parent, int old_child, int new_child);
+	int best_sibling(const BoundingBox& box); // SAH branch and bound over the tree
+	void refit_up(int idx); // boxes from idx to the root, with rotations on the way
+	bool rotate(int idx); // swap a child with a grandchild when that shrinks the tree
+	template <typename N> Intersection locate_wide(const NodeArray<N>& wide, Ray& ray, int start = 0); // below wide node 'start'
+	template <typename N> bool occluded_wide(const NodeArray<N>& wide, Ray& ray, float tmax);
+	template <int W> void locate_packet_wide(const NodeArray<WideBVHNode<W>>& wide, RayPacket& packet, int mask);
+	void record_stats(unsigned long long visited, unsigned long long culled, unsigned long long missed,
+		unsigned long long tested, int occlusion); // occlusion: -1 closest-hit query, else any-hit result
+	void record_packet_stats(unsigned long long visited, unsigned long long culled, unsigned long long missed,
+		unsigned long long tested, unsigned long long splits);
+	void _display(int idx, int depth);
 	void _cleanup(BVHNode<T>* r);
 	
 public:
-	BVH<T>(std::vector<T> objects); // get objects from Scene
+	// objects from the Scene or a mesh; a BVH<PrimRef> also needs the store they index into
+	BVH<T>(const std::vector<T>& objects, BVHBuildOptions opts = BVHBuildOptions(), const PrimitiveStore* prim_store = nullptr);
 	~BVH();
-	Intersection locate(Ray& ray); // traversal func
+	Intersection locate(Ray& ray); // traversal func: closest hit closer than ray.t_max
+	bool occluded(Ray& ray, float tmax); // any hit closer than tmax, stops at the first one (shadow rays)
+	void locate_packet(RayPacket& packet, int mask); // closest hits for the rays in 'mask', written into the packet
 	void cleanup();
 	void display(); // for debugging
+	void print_summary(const char* label); // one line: size and build time
+	// Recompute every box bottom-up from the primitives' current bounds, keeping the tree shape.
+	// Much cheaper than a build, but the tree gets worse as primitives drift from where they were built.
+	void refit();
+	// Expected cost of a ray through the tree (SAH, leaves at their primitives' intersect_cost() as in
+	// the build): node areas relative to the root, so moving everything together keeps it, while
+	// primitives spreading apart inside old nodes raise it
+	float sah_cost();
+	float get_build_sah() { return build_sah; }
+	// Incremental changes for single objects, without a rebuild: insert() puts a new leaf next to
+	// the sibling that adds the least SAH cost and refits (rotating) the nodes above it; remove()
+	// takes a leaf out and lets its sibling take the parent's place. Neither may run while the
+	// tree is being traversed. They drop the wide layout (traversal falls back to binary nodes)
+	// until finish_updates() rebuilds it for the batch. Trees with quantized nodes or split
+	// references can't be edited: both return false and leave the tree as it was.
+	bool insert(T obj);
+	bool remove(T obj); // false if obj is not in the tree
+	void finish_updates();
+	// Puts the node arrays into another memory order (see BVHNodeLayout), same tree. Not while tracing.
+	void relayout(BVHNodeLayout layout);
+	int node_count() { return static_cast<int>(nodes.size() - free_nodes.size() + wideq.size()); }
+	BoundingBox bounds() { // of everything in the tree
+		if (!wideq.empty()) return quantized_bounds;
+		if (nodes.empty()) return BoundingBox();
+		return BoundingBox(glm::vec3(nodes[0].bmin[0], nodes[0].bmin[1], nodes[0].bmin[2]),
+			glm::vec3(nodes[0].bmax[0], nodes[0].bmax[1], nodes[0].bmax[2]));
+	}
+	int prim_count() { return static_cast<int>(prims.size() - free_prims.size()); }
+	double get_build_ms() { return build_ms; }
+	void print_traversal_stats(const char* label);
+	void reset_traversal_stats();
 };
 
-// Bounding Volume Hierarchies acceleration structure
+// Bounding Volume Hierarchies acceleration structure (build-time pointer tree)
 template <typename T>
 class BVHNode {
 public:
 	BoundingBox box;  // Axis-Aligned Bounding Box (or any other bounding volume)
 	BVHNode<T>* left;
 	BVHNode<T>* right;
-	// std::vector<BVHNode<T>*> children; // leaf node if children == 0 and obj is not NULL
-	T obj;	   // Only used in leaf nodes (otherwise, NULL)
+	int first_prim;   // Only used in leaf nodes: start of its range in build order
 	int held_objects; // how many objects are held below this
 
-	// min/max coordinates to bounding boxes; if 'corners' is true, then xyz are corner1 and corner2 instead
 	BVHNode<T>(int total_objs);
-	BVHNode<T>(glm::vec3 min_xyz, glm::vec3 max_xyz, T obj = NULL);
+	BVHNode<T>(const BoundingBox& box, int first, int count); // leaf over a range of primitives
 	bool is_leaf_node() const;
-	bool check_intersection(Ray& r);
 };
 
 
@@ -95,215 +308,1772 @@ public:
 
 
 template <typename T>
-BVH<T>::BVH(std::vector<T> objects) { // objects can be of Object class, or Triangles
+BVH<T>::BVH(const std::vector<T>& objects, BVHBuildOptions opts, const PrimitiveStore* prim_store) { // objects can be of Object class, or Triangles
+	options = opts;
+	store = prim_store;
+	options.bins = std::max(2, std::min(options.bins, BVH_MAX_BINS));
+	options.max_leaf_size = std::max(1, options.max_leaf_size);
+	options.width = (options.width >= 8) ? 8 : (options.width >= 4) ? 4 : 2;
 	if (objects.size() < 1) { // if no objects, BVH is NULL
 		root = nullptr;
 		return;
 	}
+	auto start = std::chrono::steady_clock::now();
 
-	// for every object, wrap with a BVHNode (leaf-node level)
-	std::vector<BVHNode<T>*> temp{};
+	// for every object, record its bounding box and centroid
+	build_prims.reserve(objects.size());
 	for (int i = 0; i < objects.size(); i++) {
-		ObjectType objtype = objects[i]->get_type();
+		ObjectType objtype = prim_object(store, objects[i])->get_type();
 
 		if (objtype == SPHERE || objtype == TRIANGLE) {
-			// every bounding box is just the center of the sphere +/- radius
-			BVHNode<T>* new_node = new BVHNode<T>(
-				objects[i]->get_xyz_extrema(false), // minimum
-				objects[i]->get_xyz_extrema(true),  // maximum
-				objects[i]
-			);
-
-			temp.push_back(new_node);
+			BuildPrim p;
+			p.box = prim_box(objects[i]);
+			p.centroid = p.box.centroid();
+			p.index = i;
+			p.cost = prim_object(store, objects[i])->intersect_cost();
+			build_prims.push_back(p);
 		}
 		else {
 			std::cout << "BVH::BVH::Constructor only allows objects of type SPHERE or TRIANGLE.\n";
-			for (auto& leaf : temp) { // release new_nodes in this degenerate case
-				delete leaf;
-			}
+			build_prims.clear();
 			return;
 		}
 	}
 
-	// with all objects wrapped in Nodes, create the binary tree/BVH starting from root
-	root = split_nodes(root, temp); // recursive call that creates the entire BVH
+	// create the binary tree/BVH starting from root; big subtrees are built in parallel
+	if (options.method == BVH_BUILD_LBVH) {
+		BoundingBox centroid_bounds = BoundingBox::empty();
+		for (const BuildPrim& p : build_prims) {
+			centroid_bounds.expand(p.centroid);
+		}
+		glm::vec3 extent = glm::max(centroid_bounds.c2 - centroid_bounds.c1, glm::vec3(FLT_MIN));
+		int n = static_cast<int>(build_prims.size());
+		morton_keys.resize(n);
+		std::vector<int> order(n);
+		ThreadPool::shared().parallel_for((n + BVH_PARALLEL_THRESHOLD - 1) / BVH_PARALLEL_THRESHOLD, [&](int c) {
+			for (int i = c * BVH_PARALLEL_THRESHOLD; i < std::min(n, (c + 1) * BVH_PARALLEL_THRESHOLD); i++) {
+				morton_keys[i] = morton_code((build_prims[i].centroid - centroid_bounds.c1) / extent);
+				order[i] = i;
+			}
+		});
+		radix_sort(morton_keys, order, 63);
+		std::vector<BuildPrim> sorted(n);
+		for (int i = 0; i < n; i++) {
+			sorted[i] = build_prims[order[i]];
+		}
+		build_prims.swap(sorted);
+		root = build_linear(0, n);
+		std::vector<uint64_t>().swap(morton_keys);
+	}
+	else if (options.spatial_split_budget > 0.0f && build_prims.size() > 1) {
+		build_objects = &objects;
+		int budget = static_cast<int>(options.spatial_split_budget * build_prims.size());
+		std::vector<BuildPrim> refs;
+		refs.swap(build_prims);
+		BoundingBox bounds = BoundingBox::empty();
+		for (const BuildPrim& p : refs) {
+			bounds.expand(p.box);
+		}
+		build_root_area = bounds.surface_area();
+		std::vector<BuildPrim> leaves; // references in leaf order, becomes build_prims for flatten()
+		leaves.reserve(refs.size());
+		int prim_total = static_cast<int>(refs.size());
+		root = build_spatial(refs, 0, budget, leaves);
+		build_prims.swap(leaves); // flatten() reads the leaves' references from build_prims
+		split_refs = static_cast<int>(build_prims.size()) - prim_total;
+		build_objects = nullptr;
+	}
+	else {
+		root = build_range(0, static_cast<int>(build_prims.size()));
+	}
+
+	// copy into the contiguous array, then the pointer tree is no longer needed
+	nodes = NodeArray<LinearBVHNode>(NodeAllocator<LinearBVHNode>(options.huge_pages));
+	nodes.reserve(2 * build_prims.size() - 1);
+	prims.reserve(build_prims.size());
+	flatten(root, objects, 0);
+	nodes.shrink_to_fit(); // the reserve above assumed one primitive per leaf
+	cleanup();
+	std::vector<BuildPrim>().swap(build_prims);
+	if (options.layout != BVH_LAYOUT_DEPTH_FIRST) {
+		reorder_nodes();
+	}
+
+	build_wide();
+	build_sah = sah_cost();
+	if (options.quantized) {
+		quantize();
+	}
+
+	build_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
 }
 
 template <typename T>
-float BVH<T>::SAH_cost(std::vector<float> cumulative_sa, int prims_on_left) {
-	// cost function (of surface area)
-	// prims_on_left represents (inclusively) the number of primitives on the (to-be) left child
-	int total_size = static_cast<int>(cumulative_sa.size());
+BVHNode<T>* BVH<T>::build_range(int begin, int end) {
+	int count = end - begin;
+	BoundingBox bounds = BoundingBox::empty();
+	BoundingBox centroid_bounds = BoundingBox::empty();
+	float leaf_cost = 0.0f; // testing everything here
+	for (int i = begin; i < end; i++) {
+		bounds.expand(build_prims[i].box);
+		centroid_bounds.expand(build_prims[i].centroid);
+		leaf_cost += build_prims[i].cost;
+	}
+
+	if (count == 1) {
+		return new BVHNode<T>(bounds, begin, 1);
+	}
 
-	if (total_size - 1 < prims_on_left) { return -1.0f; }
-	if (total_size < 1) { return 0.0f; }
-	if (total_size == 1) { return cumulative_sa[0]; }
+	BVHSplit split = find_object_split(build_prims.data() + begin, count, bounds, centroid_bounds);
+	int bins = options.bins;
+	int best_axis = split.axis;
+	int best_border = split.border;
+	glm::vec3 extent = centroid_bounds.c2 - centroid_bounds.c1;
+
+	int mid;
+	if (best_axis == -1) { // coincident centroids
+		if (count <= options.max_leaf_size) {
+			return new BVHNode<T>(bounds, begin, count);
+		}
+		int axis = 0; // split the widest box extent at the median
+		glm::vec3 size = bounds.c2 - bounds.c1;
+		if (size.y > size[axis]) axis = 1;
+		if (size.z > size[axis]) axis = 2;
+		mid = partition_median(begin, end, axis);
+	}
+	else {
+		if (count <= options.max_leaf_size && leaf_cost <= split.cost) {
+			return new BVHNode<T>(bounds, begin, count); // splitting would not pay off
+		}
+		float lo = centroid_bounds.c1[best_axis];
+		float scale = bins / extent[best_axis];
+		int axis = best_axis;
+		int border = best_border;
+		BuildPrim* split = std::partition(build_prims.data() + begin, build_prims.data() + end,
+			[axis, border, bins, lo, scale](const BuildPrim& p) {
+				return bvh_bin((p.centroid[axis] - lo) * scale, bins) < border;
+			});
+		mid = static_cast<int>(split - build_prims.data());
+	}
 
-	float SA_left = cumulative_sa[prims_on_left];
-	float SA_right = cumulative_sa[total_size - 1] - cumulative_sa[prims_on_left];
+	BVHNode<T>* r = new BVHNode<T>(count); // this constructor keeps track of held objects
+	r->box = bounds;
 
-	return (prims_on_left + 1) * SA_left + (total_size - prims_on_left) * SA_right;
+	// recursively create new nodes for split objects; the two halves touch disjoint ranges
+	if (count >= BVH_PARALLEL_THRESHOLD) {
+		ThreadPool& pool = ThreadPool::shared();
+		TaskGroup group;
+		pool.submit([this, r, begin, mid]() { r->left = build_range(begin, mid); }, group);
+		r->right = build_range(mid, end);
+		pool.wait(group);
+	}
+	else {
+		r->left = build_range(begin, mid);
+		r->right = build_range(mid, end);
+	}
+	return r;
 }
 
 template <typename T>
-int* BVH<T>::min_SAH_params(std::vector<BVHNode<T>*> temp) {
-	int params[2]{ 0, 0 };
-	float min_SAH = (float)INT_MAX;
-	int best_axis = 0; // 0: X, 1: Y, 2: Z
-	int split_pos = 0;
+BVHSplit BVH<T>::find_object_split(const BuildPrim* refs, int count, const BoundingBox& bounds, const BoundingBox& centroid_bounds) {
+	// bin centroids along every axis and cost each bin border with the real child bounds
+	BVHSplit best;
+	int bins = options.bins;
+	glm::vec3 extent = centroid_bounds.c2 - centroid_bounds.c1;
+	float parent_area = bounds.surface_area();
+
+	for (int axis = 0; axis < 3; axis++) {
+		float scale = bins / extent[axis];
+		if (extent[axis] <= 0.0f || !std::isfinite(scale)) {
+			continue; // every centroid on one plane (or too close to tell apart), nothing to split
+		}
+		BoundingBox bin_box[BVH_MAX_BINS];
+		int bin_count[BVH_MAX_BINS] = { 0 };
+		float bin_cost[BVH_MAX_BINS] = { 0.0f }; // primitives differ (a mesh instance is a whole BVH query)
+		for (int b = 0; b < bins; b++) {
+			bin_box[b] = BoundingBox::empty();
+		}
+		for (int i = 0; i < count; i++) {
+			int b = bvh_bin((refs[i].centroid[axis] - centroid_bounds.c1[axis]) * scale, bins);
+			bin_count[b]++;
+			bin_cost[b] += refs[i].cost;
+			bin_box[b].expand(refs[i].box);
+		}
 
-	if (temp.size() <= 1) { // nothing to be done if <1 objects
-		return params;
+		// sweep from the right, then from the left, so each border costs O(1)
+		BoundingBox right_box[BVH_MAX_BINS];
+		int right_count[BVH_MAX_BINS];
+		float right_cost[BVH_MAX_BINS];
+		BoundingBox acc = BoundingBox::empty();
+		int n = 0;
+		float c = 0.0f;
+		for (int b = bins - 1; b > 0; b--) {
+			acc.expand(bin_box[b]);
+			n += bin_count[b];
+			c += bin_cost[b];
+			right_box[b] = acc;
+			right_count[b] = n;
+			right_cost[b] = c;
+		}
+		acc = BoundingBox::empty();
+		n = 0;
+		c = 0.0f;
+		for (int border = 1; border < bins; border++) {
+			acc.expand(bin_box[border - 1]);
+			n += bin_count[border - 1];
+			c += bin_cost[border - 1];
+			if (n == 0 || right_count[border] == 0) {
+				continue; // one side empty
+			}
+			float cost = SAH_TRAVERSAL_COST +
+				(acc.surface_area() * c + right_box[border].surface_area() * right_cost[border]) / parent_area;
+			if (cost < best.cost) {
+				best.cost = cost;
+				best.axis = axis;
+				best.border = border;
+				best.left = acc;
+				best.right = right_box[border];
+				best.left_count = n;
+				best.right_count = right_count[border];
+			}
+		}
 	}
+	return best;
+}
 
-	// for every node, get the smallest SAH score axis
-	for (int axis = 0; axis < 3; axis++) { // (x, y, z)
-		// sort based on axes
-		std::sort(temp.begin(), temp.end(),
-			[axis](const BVHNode<T>* a, const BVHNode<T>* b) {
-				// take centroids
-				glm::vec3 center1 = a->box.centroid();
-				glm::vec3 center2 = b->box.centroid();
-				return center1[axis] < center2[axis];
-			});
+template <typename T>
+BVHSplit BVH<T>::find_spatial_split(const std::vector<BuildPrim>& refs, const BoundingBox& bounds) {
+	// bins are equal slices of the node box; a reference is chopped at every border it crosses
+	// and each piece grows the bin it is in. It enters the left side of every border after its
+	// first bin and the right side of every border before its last one.
+	// Costed by reference counts: spatial splits are only used in mesh BVHs, where every
+	// triangle costs SAH_INTERSECT_COST.
+	BVHSplit best;
+	best.spatial = true;
+	int bins = options.bins;
+	int count = static_cast<int>(refs.size());
+	float parent_area = bounds.surface_area();
+
+	for (int axis = 0; axis < 3; axis++) {
+		float lo = bounds.c1[axis];
+		float width = (bounds.c2[axis] - lo) / bins;
+		if (width <= 0.0f) {
+			continue;
+		}
+		BoundingBox bin_box[BVH_MAX_BINS];
+		int entries[BVH_MAX_BINS] = { 0 }; // references starting in the bin
+		int exits[BVH_MAX_BINS] = { 0 };   // references ending in the bin
+		for (int b = 0; b < bins; b++) {
+			bin_box[b] = BoundingBox::empty();
+		}
+		for (const BuildPrim& ref : refs) {
+			int first = bvh_bin((ref.box.c1[axis] - lo) / width, bins);
+			int last = std::max(first, bvh_bin((ref.box.c2[axis] - lo) / width, bins));
+			BoundingBox rest = ref.box;
+			for (int b = first; b < last; b++) {
+				BoundingBox left, right;
+				prim_object(store, (*build_objects)[ref.index])->split_bounds(axis, lo + (b + 1) * width, left, right);
+				left.clip(rest);
+				right.clip(rest);
+				bin_box[b].expand(left);
+				rest = right;
+			}
+			bin_box[last].expand(rest);
+			entries[first]++;
+			exits[last]++;
+		}
 
-		std::vector<float> surface_areas{};
+		BoundingBox right_box[BVH_MAX_BINS];
+		int right_count[BVH_MAX_BINS];
+		BoundingBox acc = BoundingBox::empty();
+		int n = 0;
+		for (int b = bins - 1; b > 0; b--) {
+			acc.expand(bin_box[b]);
+			n += exits[b];
+			right_box[b] = acc;
+			right_count[b] = n;
+		}
+		acc = BoundingBox::empty();
+		n = 0;
+		for (int border = 1; border < bins; border++) {
+			acc.expand(bin_box[border - 1]);
+			n += entries[border - 1];
+			if (n == 0 || right_count[border] == 0 || (n == count && right_count[border] == count)) {
+				continue; // one side empty, or nothing separated
+			}
+			float cost = SAH_TRAVERSAL_COST + SAH_INTERSECT_COST *
+				(acc.surface_area() * n + right_box[border].surface_area() * right_count[border]) / parent_area;
+			if (cost < best.cost) {
+				best.cost = cost;
+				best.axis = axis;
+				best.border = border;
+				best.plane = lo + border * width;
+				best.left = acc;
+				best.right = right_box[border];
+				best.left_count = n;
+				best.right_count = right_count[border];
+			}
+		}
+	}
+	return best;
+}
+
+template <typename T>
+BVHNode<T>* BVH<T>::make_leaf(const std::vector<BuildPrim>& refs, const BoundingBox& bounds, std::vector<BuildPrim>& leaves) {
+	int first = static_cast<int>(leaves.size());
+	leaves.insert(leaves.end(), refs.begin(), refs.end());
+	return new BVHNode<T>(bounds, first, static_cast<int>(refs.size()));
+}
+
+template <typename T>
+void BVH<T>::shift_leaves(BVHNode<T>* node, int offset) {
+	if (node->is_leaf_node()) {
+		node->first_prim += offset;
+		return;
+	}
+	shift_leaves(node->left, offset);
+	shift_leaves(node->right, offset);
+}
 
-		// run a loop taking the cumulative sum of surface areas needed for SAH
-		for (int i = 0; i < temp.size(); i++) {
-			float current_SA = temp[i]->box.surface_area(); // current object SA
-			if (i == 0) { // if first object checked
-				surface_areas.push_back(current_SA);
+template <typename T>
+BVHNode<T>* BVH<T>::build_spatial(std::vector<BuildPrim>& refs, int depth, int& budget, std::vector<BuildPrim>& leaves) {
+	int count = static_cast<int>(refs.size());
+	BoundingBox bounds = BoundingBox::empty();
+	BoundingBox centroid_bounds = BoundingBox::empty();
+	float leaf_cost = 0.0f;
+	for (const BuildPrim& ref : refs) {
+		bounds.expand(ref.box);
+		centroid_bounds.expand(ref.centroid);
+		leaf_cost += ref.cost;
+	}
+	if (count == 1) {
+		return make_leaf(refs, bounds, leaves);
+	}
+
+	BVHSplit split = find_object_split(refs.data(), count, bounds, centroid_bounds);
+	if (split.axis != -1 && depth < SBVH_MAX_DEPTH && budget > 0) {
+		// only worth it where the object split leaves overlapping children (long, thin primitives)
+		BoundingBox overlap = split.left;
+		overlap.clip(split.right);
+		if (!overlap.is_empty() && overlap.surface_area() > SBVH_MIN_OVERLAP * build_root_area) {
+			BVHSplit spatial = find_spatial_split(refs, bounds);
+			int extra = spatial.left_count + spatial.right_count - count;
+			if (spatial.axis != -1 && spatial.cost < split.cost && extra <= budget) { // else over budget: keep the object split
+				split = spatial;
+				budget -= extra;
+			}
+		}
+	}
+	if (count <= options.max_leaf_size && leaf_cost <= split.cost) {
+		return make_leaf(refs, bounds, leaves); // splitting would not pay off (or nothing to split)
+	}
+
+	std::vector<BuildPrim> left, right;
+	if (split.axis == -1) { // coincident centroids: median of the widest box extent
+		int axis = 0;
+		glm::vec3 size = bounds.c2 - bounds.c1;
+		if (size.y > size[axis]) axis = 1;
+		if (size.z > size[axis]) axis = 2;
+		int mid = count / 2;
+		std::nth_element(refs.begin(), refs.begin() + mid, refs.end(),
+			[axis](const BuildPrim& a, const BuildPrim& b) { return a.centroid[axis] < b.centroid[axis]; });
+		left.assign(refs.begin(), refs.begin() + mid);
+		right.assign(refs.begin() + mid, refs.end());
+	}
+	else if (!split.spatial) {
+		float lo = centroid_bounds.c1[split.axis];
+		float scale = options.bins / (centroid_bounds.c2[split.axis] - lo);
+		for (const BuildPrim& ref : refs) {
+			int b = bvh_bin((ref.centroid[split.axis] - lo) * scale, options.bins);
+			(b < split.border ? left : right).push_back(ref);
+		}
+	}
+	else {
+		int axis = split.axis;
+		float area_left = split.left.surface_area();
+		float area_right = split.right.surface_area();
+		int planned = split.left_count + split.right_count; // refund what unsplitting saves
+		for (const BuildPrim& ref : refs) {
+			if (ref.box.c2[axis] <= split.plane) {
+				left.push_back(ref);
+			}
+			else if (ref.box.c1[axis] >= split.plane) {
+				right.push_back(ref);
+			}
+			else {
+				// straddles: reference it from both sides, unless one side swallowing it whole is
+				// cheaper ("unsplitting")
+				BoundingBox grown_left = split.left, grown_right = split.right;
+				grown_left.expand(ref.box);
+				grown_right.expand(ref.box);
+				float cost_split = area_left * split.left_count + area_right * split.right_count;
+				float cost_left = grown_left.surface_area() * split.left_count + area_right * (split.right_count - 1);
+				float cost_right = area_left * (split.left_count - 1) + grown_right.surface_area() * split.right_count;
+				if (cost_left < cost_split && cost_left <= cost_right) {
+					left.push_back(ref);
+				}
+				else if (cost_right < cost_split) {
+					right.push_back(ref);
+				}
+				else {
+					BuildPrim l = ref, r = ref;
+					prim_object(store, (*build_objects)[ref.index])->split_bounds(axis, split.plane, l.box, r.box);
+					l.box.clip(ref.box);
+					r.box.clip(ref.box);
+					if (l.box.is_empty() || r.box.is_empty()) { // the shape itself doesn't cross
+						(l.box.is_empty() ? right : left).push_back(ref);
+						continue;
+					}
+					l.centroid = l.box.centroid();
+					r.centroid = r.box.centroid();
+					left.push_back(l);
+					right.push_back(r);
+				}
+			}
+		}
+		budget += planned - static_cast<int>(left.size() + right.size());
+	}
+	std::vector<BuildPrim>().swap(refs); // children own the references now
+	if (left.empty() || right.empty()) { // everything landed on one side (shapes hugging the plane): halve it
+		std::vector<BuildPrim> all;
+		all.swap(left.empty() ? right : left);
+		int mid = static_cast<int>(all.size()) / 2;
+		left.assign(all.begin(), all.begin() + mid);
+		right.assign(all.begin() + mid, all.end());
+	}
+
+	// what is left of the budget goes to the children by their share of the references
+	int left_budget = static_cast<int>(static_cast<long long>(budget) * left.size() / (left.size() + right.size()));
+	int right_budget = budget - left_budget;
+	budget = 0; // the children hand back what they don't use
+	BVHNode<T>* r = new BVHNode<T>(count);
+	r->box = bounds;
+	if (count >= BVH_PARALLEL_THRESHOLD) {
+		// the left task appends to 'leaves', the right subtree to its own list, moved in behind it after the join
+		ThreadPool& pool = ThreadPool::shared();
+		TaskGroup group;
+		std::vector<BuildPrim> right_leaves;
+		pool.submit([this, r, &left, depth, &left_budget, &leaves]() { r->left = build_spatial(left, depth + 1, left_budget, leaves); }, group);
+		r->right = build_spatial(right, depth + 1, right_budget, right_leaves);
+		pool.wait(group);
+		shift_leaves(r->right, static_cast<int>(leaves.size()));
+		leaves.insert(leaves.end(), right_leaves.begin(), right_leaves.end());
+		budget = left_budget + right_budget;
+	}
+	else { // one after the other: the right subtree can also use what the left one left over
+		r->left = build_spatial(left, depth + 1, left_budget, leaves);
+		right_budget += left_budget;
+		r->right = build_spatial(right, depth + 1, right_budget, leaves);
+		budget = right_budget;
+	}
+	return r;
+}
+
+template <typename T>
+BVHNode<T>* BVH<T>::build_linear(int begin, int end) {
+	int count = end - begin;
+	if (count == 1) {
+		return new BVHNode<T>(build_prims[begin].box, begin, 1);
+	}
+
+	// codes in the range share their high bits; the first differing one flips exactly once
+	int mid = begin + count / 2; // identical codes: just halve
+	uint64_t first = morton_keys[begin];
+	uint64_t diff = first ^ morton_keys[end - 1];
+	if (diff != 0) {
+		int bit = 63;
+		while (!(diff & (1ull << bit))) {
+			bit--;
+		}
+		uint64_t mask = 1ull << bit;
+		mid = static_cast<int>(std::partition_point(morton_keys.begin() + begin, morton_keys.begin() + end,
+			[mask](uint64_t key) { return !(key & mask); }) - morton_keys.begin());
+	}
+
+	// small ranges become one leaf when the SAH says this split doesn't pay off; decided from the
+	// primitives' boxes before anything below is built
+	if (count <= options.max_leaf_size) {
+		BoundingBox box_left = BoundingBox::empty(), box_right = BoundingBox::empty();
+		float cost_left = 0.0f, cost_right = 0.0f;
+		for (int i = begin; i < end; i++) {
+			(i < mid ? box_left : box_right).expand(build_prims[i].box);
+			(i < mid ? cost_left : cost_right) += build_prims[i].cost;
+		}
+		BoundingBox bounds = box_left;
+		bounds.expand(box_right);
+		float area = bounds.surface_area();
+		float split_cost = SAH_TRAVERSAL_COST +
+			(box_left.surface_area() * cost_left + box_right.surface_area() * cost_right) / area;
+		if (area <= 0.0f || cost_left + cost_right <= split_cost) {
+			return new BVHNode<T>(bounds, begin, count);
+		}
+	}
+
+	BVHNode<T>* r = new BVHNode<T>(count);
+	if (count >= BVH_PARALLEL_THRESHOLD) {
+		ThreadPool& pool = ThreadPool::shared();
+		TaskGroup group;
+		pool.submit([this, r, begin, mid]() { r->left = build_linear(begin, mid); }, group);
+		r->right = build_linear(mid, end);
+		pool.wait(group);
+	}
+	else {
+		r->left = build_linear(begin, mid);
+		r->right = build_linear(mid, end);
+	}
+	r->box = r->left->box;
+	r->box.expand(r->right->box);
+	return r;
+}
+
+template <typename T>
+int BVH<T>::partition_median(int begin, int end, int axis) {
+	int mid = begin + (end - begin) / 2;
+	std::nth_element(build_prims.begin() + begin, build_prims.begin() + mid, build_prims.begin() + end,
+		[axis](const BuildPrim& a, const BuildPrim& b) {
+			return a.centroid[axis] < b.centroid[axis];
+		});
+	return mid;
+}
+
+template <typename T>
+int BVH<T>::flatten(BVHNode<T>* node, const std::vector<T>& objects, int depth) {
+	int idx = static_cast<int>(nodes.size());
+	max_depth = std::max(max_depth, depth);
+	nodes.push_back(LinearBVHNode());
+	for (int i = 0; i < 3; i++) {
+		nodes[idx].bmin[i] = node->box.c1[i];
+		nodes[idx].bmax[i] = node->box.c2[i];
+	}
+
+	if (node->is_leaf_node()) {
+		nodes[idx].left = static_cast<int>(prims.size());
+		nodes[idx].right = -node->held_objects;
+		for (int i = 0; i < node->held_objects; i++) {
+			prims.push_back(objects[build_prims[node->first_prim + i].index]);
+		}
+		// grouped by type, so hit_leaf() can test each kind in one loop
+		std::stable_sort(prims.end() - node->held_objects, prims.end(),
+			[this](const T& a, const T& b) { return leaf_key(a) < leaf_key(b); });
+	}
+	else { // children are placed after this node (left subtree first)
+		int left = flatten(node->left, objects, depth + 1);
+		int right = flatten(node->right, objects, depth + 1);
+		nodes[idx].left = left;
+		nodes[idx].right = right;
+	}
+	return idx;
+}
+
+template <typename T>
+template <int W>
+int BVH<T>::collapse(NodeArray<WideBVHNode<W>>& out, int idx) {
+	// pull grandchildren up until W children: always open the inner child with the largest box,
+	// it is the one most rays would otherwise descend into
+	int kids[W];
+	int n = 0;
+	if (nodes[idx].is_leaf()) { // single-leaf tree
+		kids[n++] = idx;
+	}
+	else {
+		kids[n++] = nodes[idx].left;
+		kids[n++] = nodes[idx].right;
+	}
+	while (n < W) {
+		int best = -1;
+		float best_area = -1.0f;
+		for (int k = 0; k < n; k++) {
+			const LinearBVHNode& c = nodes[kids[k]];
+			if (c.is_leaf()) {
 				continue;
 			}
-			// add with previous cumulative SA sum
-			surface_areas.push_back(current_SA + surface_areas[surface_areas.size() - 1]);
+			float area = BoundingBox(glm::vec3(c.bmin[0], c.bmin[1], c.bmin[2]),
+				glm::vec3(c.bmax[0], c.bmax[1], c.bmax[2])).surface_area();
+			if (area > best_area) {
+				best_area = area;
+				best = k;
+			}
+		}
+		if (best == -1) {
+			break; // only leaves left
+		}
+		int opened = kids[best];
+		kids[best] = nodes[opened].left;
+		kids[n++] = nodes[opened].right;
+	}
+
+	int slot = static_cast<int>(out.size());
+	out.push_back(WideBVHNode<W>());
+	for (int k = 0; k < W; k++) {
+		if (k >= n) {
+			out[slot].clear_slot(k);
+			continue;
+		}
+		const LinearBVHNode& c = nodes[kids[k]];
+		for (int a = 0; a < 3; a++) {
+			out[slot].lo[a][k] = c.bmin[a];
+			out[slot].hi[a][k] = c.bmax[a];
+		}
+		if (c.is_leaf()) {
+			out[slot].child[k] = c.prim_offset();
+			out[slot].count[k] = c.prim_count();
+		}
+		else {
+			int child = collapse(out, kids[k]); // may reallocate 'out', so index again below
+			out[slot].child[k] = child;
+			out[slot].count[k] = 0;
+		}
+	}
+	return slot;
+}
+
+template <typename T>
+void BVH<T>::build_wide() {
+	wide4 = NodeArray<WideBVHNode<4>>(NodeAllocator<WideBVHNode<4>>(options.huge_pages));
+	wide8 = NodeArray<WideBVHNode<8>>(NodeAllocator<WideBVHNode<8>>(options.huge_pages));
+	if (options.width == 4) {
+		wide4.reserve(nodes.size() / 2 + 1);
+		collapse(wide4, 0);
+		wide4.shrink_to_fit();
+		reorder_wide(wide4);
+	}
+	else if (options.width == 8) {
+		wide8.reserve(nodes.size() / 4 + 1);
+		collapse(wide8, 0);
+		wide8.shrink_to_fit();
+		reorder_wide(wide8);
+	}
+}
+
+template <typename T>
+void BVH<T>::reorder_nodes() {
+	std::vector<int> order = bvh_layout_order(static_cast<int>(nodes.size()), [this](int idx, int* kids) {
+		if (nodes[idx].is_leaf()) {
+			return 0;
+		}
+		kids[0] = nodes[idx].left;
+		kids[1] = nodes[idx].right;
+		return 2;
+	}, options.layout, sizeof(LinearBVHNode));
+
+	std::vector<int> moved_to(nodes.size(), -1);
+	for (int k = 0; k < static_cast<int>(order.size()); k++) {
+		moved_to[order[k]] = k;
+	}
+	NodeArray<LinearBVHNode> reordered(order.size(), LinearBVHNode(), NodeAllocator<LinearBVHNode>(options.huge_pages));
+	for (int k = 0; k < static_cast<int>(order.size()); k++) {
+		reordered[k] = nodes[order[k]];
+		if (!reordered[k].is_leaf()) {
+			reordered[k].left = moved_to[reordered[k].left];
+			reordered[k].right = moved_to[reordered[k].right];
+		}
+	}
+	if (!parents.empty()) { // edited tree: keep the links in step (free slots are gone now)
+		std::vector<int> relinked(order.size(), -1);
+		for (int k = 0; k < static_cast<int>(order.size()); k++) {
+			int parent = parents[order[k]];
+			relinked[k] = (parent == -1) ? -1 : moved_to[parent];
+		}
+		parents.swap(relinked);
+		std::vector<int> moved_heights(order.size(), 0);
+		for (int k = 0; k < static_cast<int>(order.size()); k++) {
+			moved_heights[k] = heights[order[k]];
+		}
+		heights.swap(moved_heights);
+		for (int& leaf : prim_leaves) {
+			leaf = (leaf == -1) ? -1 : moved_to[leaf];
+		}
+		free_nodes.clear();
+	}
+	nodes.swap(reordered);
+}
+
+template <typename T>
+template <typename N>
+void BVH<T>::reorder_wide(NodeArray<N>& wide) {
+	const int W = N::WIDTH;
+	if (options.layout == BVH_LAYOUT_DEPTH_FIRST) {
+		return; // collapse() already writes depth-first
+	}
+	std::vector<int> order = bvh_layout_order(static_cast<int>(wide.size()), [&wide](int idx, int* kids) {
+		int n = 0;
+		for (int k = 0; k < W; k++) {
+			if (wide[idx].count[k] == 0) {
+				kids[n++] = wide[idx].child[k];
+			}
+		}
+		return n;
+	}, options.layout, sizeof(N));
+
+	std::vector<int> moved_to(wide.size(), -1);
+	for (int k = 0; k < static_cast<int>(order.size()); k++) {
+		moved_to[order[k]] = k;
+	}
+	NodeArray<N> reordered(order.size(), N(), NodeAllocator<N>(options.huge_pages));
+	for (int k = 0; k < static_cast<int>(order.size()); k++) {
+		reordered[k] = wide[order[k]];
+		for (int c = 0; c < W; c++) {
+			if (reordered[k].count[c] == 0) {
+				reordered[k].child[c] = moved_to[reordered[k].child[c]];
+			}
+		}
+	}
+	wide.swap(reordered);
+}
+
+template <typename T>
+void BVH<T>::quantize() {
+	NodeArray<WideBVHNode<4>> wide;
+	if (options.width == 4) {
+		wide.swap(wide4);
+	}
+	else {
+		wide.reserve(nodes.size() / 2 + 1);
+		collapse(wide, 0); // depth-first; reordered below like the others
+	}
+	for (const WideBVHNode<4>& w : wide) {
+		for (int k = 0; k < 4; k++) {
+			if (w.count[k] > INT8_MAX) {
+				std::cout << "[BVH] leaves over " << INT8_MAX << " primitives, keeping the float nodes\n";
+				build_wide();
+				return;
+			}
+		}
+	}
+
+	quantized_bounds = bounds();
+	wideq = NodeArray<QuantizedBVHNode>(NodeAllocator<QuantizedBVHNode>(options.huge_pages));
+	wideq.resize(wide.size());
+	for (size_t idx = 0; idx < wide.size(); idx++) {
+		const WideBVHNode<4>& w = wide[idx];
+		QuantizedBVHNode& q = wideq[idx];
+		std::memset(&q, 0, sizeof(q));
+		BoundingBox box = BoundingBox::empty(); // the node's own box: its children together
+		for (int k = 0; k < 4; k++) {
+			q.count[k] = static_cast<int8_t>(w.count[k]);
+			q.child[k] = w.child[k];
+			if (w.count[k] >= 0) {
+				box.expand(BoundingBox(glm::vec3(w.lo[0][k], w.lo[1][k], w.lo[2][k]), glm::vec3(w.hi[0][k], w.hi[1][k], w.hi[2][k])));
+			}
+		}
+		for (int a = 0; a < 3; a++) {
+			// smallest power of two step whose 255 steps cover the box
+			q.origin[a] = box.c1[a];
+			float extent = box.c2[a] - box.c1[a];
+			int e = (extent > 0.0f) ? static_cast<int>(std::ceil(std::log2(extent / 255.0f))) : INT8_MIN;
+			e = std::max<int>(INT8_MIN, std::min<int>(INT8_MAX, e));
+			while (e < INT8_MAX && q.origin[a] + 255.0f * quantized_scale(static_cast<int8_t>(e)) < box.c2[a]) {
+				e++;
+			}
+			q.exponent[a] = static_cast<int8_t>(e);
+			float scale = quantized_scale(q.exponent[a]);
+			for (int k = 0; k < 4; k++) {
+				if (w.count[k] < 0) {
+					q.qlo[a][k] = 255; // inverted box, like WideBVHNode::clear_slot
+					q.qhi[a][k] = 0;
+					continue;
+				}
+				float lo = std::floor((w.lo[a][k] - q.origin[a]) / scale);
+				float hi = std::ceil((w.hi[a][k] - q.origin[a]) / scale);
+				q.qlo[a][k] = static_cast<uint8_t>(std::max(0.0f, std::min(255.0f, lo)));
+				q.qhi[a][k] = static_cast<uint8_t>(std::max(0.0f, std::min(255.0f, hi)));
+			}
+		}
+		// the division above may round either way: step outwards until the decoded box contains the real one
+		WideBVHNode<4> decoded;
+		decode_children(q, decoded);
+		for (int a = 0; a < 3; a++) {
+			for (int k = 0; k < 4; k++) {
+				while (w.count[k] >= 0 && q.qlo[a][k] > 0 && decoded.lo[a][k] > w.lo[a][k]) {
+					q.qlo[a][k]--;
+					decoded.lo[a][k] = q.origin[a] + static_cast<float>(q.qlo[a][k]) * quantized_scale(q.exponent[a]);
+				}
+				while (w.count[k] >= 0 && q.qhi[a][k] < 255 && decoded.hi[a][k] < w.hi[a][k]) {
+					q.qhi[a][k]++;
+					decoded.hi[a][k] = q.origin[a] + static_cast<float>(q.qhi[a][k]) * quantized_scale(q.exponent[a]);
+				}
+			}
+		}
+	}
+	reorder_wide(wideq);
+
+	// nothing else reads the float nodes any more
+	NodeArray<LinearBVHNode>().swap(nodes);
+	NodeArray<WideBVHNode<4>>().swap(wide4);
+	NodeArray<WideBVHNode<8>>().swap(wide8);
+}
+
+template <typename T>
+void BVH<T>::relayout(BVHNodeLayout layout) {
+	options.layout = layout;
+	if (!wideq.empty()) {
+		reorder_wide(wideq);
+		return;
+	}
+	if (nodes.empty()) {
+		return;
+	}
+	reorder_nodes();
+	build_wide();
+}
+
+template <typename T>
+void BVH<T>::tree_order(std::vector<int>& order) {
+	order.clear();
+	if (nodes.empty()) {
+		return;
+	}
+	order.reserve(nodes.size());
+	order.push_back(0);
+	for (size_t k = 0; k < order.size(); k++) {
+		const LinearBVHNode& n = nodes[order[k]];
+		if (!n.is_leaf()) {
+			order.push_back(n.left);
+			order.push_back(n.right);
+		}
+	}
+}
+
+template <typename T>
+void BVH<T>::refit() {
+	if (nodes.empty()) {
+		return;
+	}
+	// every child comes after its parent in 'order', so a reverse sweep is bottom-up
+	// (the node array itself is only in that order until the first insert/remove)
+	std::vector<int> order;
+	tree_order(order);
+	for (int k = static_cast<int>(order.size()) - 1; k >= 0; k--) {
+		LinearBVHNode& n = nodes[order[k]];
+		BoundingBox box = BoundingBox::empty();
+		if (n.is_leaf()) {
+			for (int i = n.prim_offset(); i < n.prim_offset() + n.prim_count(); i++) {
+				box.expand(prim_box(prims[i]));
+			}
+		}
+		else {
+			box = node_box(n.left);
+			box.expand(node_box(n.right));
+		}
+		set_node_box(order[k], box);
+	}
+	build_wide(); // the wide nodes copy child boxes; collapsing again is linear and keeps the same grouping
+}
+
+template <typename T>
+float BVH<T>::sah_cost() {
+	if (nodes.empty()) {
+		return 0.0f;
+	}
+	std::vector<int> order;
+	tree_order(order);
+	float cost = 0.0f;
+	for (int idx : order) {
+		const LinearBVHNode& n = nodes[idx];
+		float node_cost = SAH_TRAVERSAL_COST;
+		if (n.is_leaf()) { // each primitive at its own intersect_cost(), as the build weighed it
+			node_cost = 0.0f;
+			for (int i = n.prim_offset(); i < n.prim_offset() + n.prim_count(); i++) {
+				node_cost += prim_object(store, prims[i])->intersect_cost();
+			}
 		}
+		cost += node_box(idx).surface_area() * node_cost;
+	}
+	float root_area = node_box(0).surface_area();
+	return (root_area > 0.0f) ? cost / root_area : cost;
+}
+
+template <typename T>
+BoundingBox BVH<T>::node_box(int idx) {
+	const LinearBVHNode& n = nodes[idx];
+	return BoundingBox(glm::vec3(n.bmin[0], n.bmin[1], n.bmin[2]), glm::vec3(n.bmax[0], n.bmax[1], n.bmax[2]));
+}
 
-		// compute minimum SAH (cost function)
-		// why temp.size() - 1: avoid the (all vs none) case
-		for (int i = 0; i < temp.size(); i++) {
-			float cost = SAH_cost(surface_areas, i);
-			if (cost == -1) {
-				continue; // error case; should not happen
+template <typename T>
+void BVH<T>::set_node_box(int idx, const BoundingBox& box) {
+	for (int a = 0; a < 3; a++) {
+		nodes[idx].bmin[a] = box.c1[a];
+		nodes[idx].bmax[a] = box.c2[a];
+	}
+}
+
+////////////////////////////// incremental updates ////////////////////////////////
+
+template <typename T>
+void BVH<T>::init_updates() {
+	if (!nodes.empty() && parents.size() == nodes.size()) {
+		return; // links already kept
+	}
+	parents.assign(nodes.size(), -1);
+	prim_leaves.assign(prims.size(), -1);
+	for (int idx = 0; idx < static_cast<int>(nodes.size()); idx++) {
+		const LinearBVHNode& n = nodes[idx];
+		if (!n.is_leaf()) {
+			parents[n.left] = idx;
+			parents[n.right] = idx;
+		}
+		else {
+			for (int i = n.prim_offset(); i < n.prim_offset() + n.prim_count(); i++) {
+				prim_leaves[i] = idx;
 			}
-			if (cost < min_SAH) {
-				// update minimum SAH + best axis (x,y,z)
-				min_SAH = cost;
-				best_axis = axis;
-				split_pos = i;
-				std::cout << "[axis: " << best_axis << ", splitidx: " << split_pos << "]new lowest cost : " << cost << '\n';
+		}
+	}
+	prim_slots.clear();
+	for (int i = 0; i < static_cast<int>(prims.size()); i++) {
+		prim_slots[prims[i]] = i;
+	}
+	heights.assign(nodes.size(), 0);
+	std::vector<int> order;
+	tree_order(order);
+	for (int k = static_cast<int>(order.size()) - 1; k >= 0; k--) { // children before parents
+		const LinearBVHNode& n = nodes[order[k]];
+		if (!n.is_leaf()) {
+			heights[order[k]] = 1 + std::max(heights[n.left], heights[n.right]);
+		}
+	}
+}
+
+template <typename T>
+int BVH<T>::alloc_node() {
+	if (!free_nodes.empty()) {
+		int idx = free_nodes.back();
+		free_nodes.pop_back();
+		return idx;
+	}
+	nodes.push_back(LinearBVHNode());
+	parents.push_back(-1);
+	heights.push_back(0);
+	return static_cast<int>(nodes.size()) - 1;
+}
+
+template <typename T>
+void BVH<T>::move_node(int from, int to) {
+	nodes[to] = nodes[from];
+	parents[to] = parents[from];
+	heights[to] = heights[from];
+	const LinearBVHNode& n = nodes[to];
+	if (!n.is_leaf()) {
+		parents[n.left] = to;
+		parents[n.right] = to;
+	}
+	else {
+		for (int i = n.prim_offset(); i < n.prim_offset() + n.prim_count(); i++) {
+			prim_leaves[i] = to;
+		}
+	}
+}
+
+template <typename T>
+void BVH<T>::replace_child(int parent, int old_child, int new_child) {
+	if (nodes[parent].left == old_child) {
+		nodes[parent].left = new_child;
+	}
+	else {
+		nodes[parent].right = new_child;
+	}
+	parents[new_child] = parent;
+}
+
+template <typename T>
+int BVH<T>::best_sibling(const BoundingBox& box) {
+	// cost of pairing with node n: the new parent's area (union of n and box) plus the growth of
+	// every ancestor of n; the growth only accumulates going down, which bounds whole subtrees
+	struct Candidate {
+		int idx;
+		float inherited; // area added to the ancestors of idx
+	};
+	float box_area = box.surface_area();
+	int best = 0;
+	float best_cost = FLT_MAX;
+	std::vector<Candidate> queue;
+	queue.push_back(Candidate{ 0, 0.0f });
+	while (!queue.empty()) {
+		Candidate c = queue.back();
+		queue.pop_back();
+		BoundingBox joined = node_box(c.idx);
+		float own_area = joined.surface_area();
+		joined.expand(box);
+		float direct = joined.surface_area();
+		float cost = direct + c.inherited;
+		if (cost < best_cost) {
+			best_cost = cost;
+			best = c.idx;
+		}
+		float inherited = c.inherited + direct - own_area;
+		if (!nodes[c.idx].is_leaf() && box_area + inherited < best_cost) { // children can't beat this bound otherwise
+			queue.push_back(Candidate{ nodes[c.idx].left, inherited });
+			queue.push_back(Candidate{ nodes[c.idx].right, inherited });
+		}
+	}
+	return best;
+}
+
+template <typename T>
+bool BVH<T>::rotate(int idx) {
+	// try swapping one child with a grandchild on the other side; keep the swap that shrinks
+	// the changed inner child the most (the node's own box is unchanged by any of them)
+	int kids[2] = { nodes[idx].left, nodes[idx].right };
+	int best_from = -1, best_to = -1;
+	float best_gain = 0.0f;
+	for (int side = 0; side < 2; side++) {
+		int b = kids[side];      // child that moves down
+		int c = kids[1 - side];  // inner child whose child moves up
+		if (nodes[c].is_leaf()) {
+			continue;
+		}
+		float c_area = node_box(c).surface_area();
+		int grand[2] = { nodes[c].left, nodes[c].right };
+		for (int g = 0; g < 2; g++) {
+			BoundingBox swapped = node_box(b); // c would hold b and the other grandchild
+			swapped.expand(node_box(grand[1 - g]));
+			float gain = c_area - swapped.surface_area();
+			if (gain > best_gain) {
+				best_gain = gain;
+				best_from = b;
+				best_to = grand[g];
 			}
 		}
 	}
-	params[0] = best_axis;
-	params[1] = split_pos;
+	if (best_from == -1) {
+		return false;
+	}
+	int c = parents[best_to];
+	replace_child(idx, best_from, best_to);
+	replace_child(c, best_to, best_from);
+	BoundingBox box = node_box(nodes[c].left);
+	box.expand(node_box(nodes[c].right));
+	set_node_box(c, box);
+	heights[c] = 1 + std::max(heights[nodes[c].left], heights[nodes[c].right]);
+	return true;
+}
 
-	return params;
+template <typename T>
+void BVH<T>::refit_up(int idx) {
+	while (idx != -1) {
+		BoundingBox box = node_box(nodes[idx].left);
+		box.expand(node_box(nodes[idx].right));
+		set_node_box(idx, box);
+		rotate(idx);
+		heights[idx] = 1 + std::max(heights[nodes[idx].left], heights[nodes[idx].right]);
+		idx = parents[idx];
+	}
+	max_depth = heights[0];
+}
+
+template <typename T>
+bool BVH<T>::insert(T obj) {
+	if (!wideq.empty() || split_refs > 0) {
+		std::cout << "[BVH] insert: quantized or spatially split trees can't be edited, rebuild instead\n";
+		return false;
+	}
+	init_updates();
+	BoundingBox box = prim_box(obj);
+	int slot;
+	if (!free_prims.empty()) { // a slot remove() released (in no leaf's range any more)
+		slot = free_prims.back();
+		free_prims.pop_back();
+		prims[slot] = obj;
+	}
+	else {
+		slot = static_cast<int>(prims.size());
+		prims.push_back(obj);
+		prim_leaves.push_back(-1);
+	}
+	prim_slots[obj] = slot;
+	wide4.clear();
+	wide8.clear();
+
+	int leaf = alloc_node();
+	prim_leaves[slot] = leaf;
+	set_node_box(leaf, box);
+	nodes[leaf].left = slot;
+	nodes[leaf].right = -1;
+	heights[leaf] = 0;
+	if (leaf == 0) { // first object of an empty tree
+		max_depth = 0;
+		return true;
+	}
+
+	int sibling = best_sibling(box);
+	int parent;
+	if (sibling == 0) { // new root: the traversal starts at node 0, so the old root moves out
+		int moved = alloc_node();
+		move_node(0, moved);
+		parent = 0;
+		parents[0] = -1;
+		sibling = moved;
+	}
+	else {
+		parent = alloc_node();
+		replace_child(parents[sibling], sibling, parent);
+	}
+	nodes[parent].left = sibling;
+	nodes[parent].right = leaf;
+	parents[sibling] = parent;
+	parents[leaf] = parent;
+	refit_up(parent);
+	return true;
+}
+
+template <typename T>
+bool BVH<T>::remove(T obj) {
+	if (!wideq.empty() || split_refs > 0) {
+		std::cout << "[BVH] remove: quantized or spatially split trees can't be edited, rebuild instead\n";
+		return false;
+	}
+	init_updates();
+	auto found = prim_slots.find(obj);
+	if (found == prim_slots.end()) {
+		return false;
+	}
+	int slot = found->second;
+	int leaf = prim_leaves[slot];
+	prim_slots.erase(found);
+	wide4.clear();
+	wide8.clear();
+
+	LinearBVHNode& n = nodes[leaf];
+	int last = n.prim_offset() + n.prim_count() - 1; // last slot of the leaf becomes dead
+	if (slot != last) {
+		prims[slot] = prims[last];
+		prim_slots[prims[slot]] = slot;
+	}
+	prims[last] = T();
+	prim_leaves[last] = -1;
+	free_prims.push_back(last);
+	n.right++; // one primitive less
+	if (n.prim_count() > 0) { // leaf keeps other primitives
+		BoundingBox box = BoundingBox::empty();
+		for (int i = n.prim_offset(); i < n.prim_offset() + n.prim_count(); i++) {
+			box.expand(prim_box(prims[i]));
+		}
+		set_node_box(leaf, box);
+		if (parents[leaf] != -1) {
+			refit_up(parents[leaf]);
+		}
+		return true;
+	}
+
+	if (leaf == 0) { // tree is empty now
+		nodes.clear();
+		parents.clear();
+		heights.clear();
+		free_nodes.clear();
+		prims.clear();
+		prim_slots.clear();
+		prim_leaves.clear();
+		free_prims.clear();
+		max_depth = 0;
+		return true;
+	}
+	int parent = parents[leaf];
+	int sibling = (nodes[parent].left == leaf) ? nodes[parent].right : nodes[parent].left;
+	free_nodes.push_back(leaf);
+	if (parent == 0) { // the sibling becomes the root, which has to stay at node 0
+		move_node(sibling, 0);
+		parents[0] = -1;
+		free_nodes.push_back(sibling);
+		max_depth = heights[0];
+	}
+	else {
+		int grandparent = parents[parent];
+		replace_child(grandparent, parent, sibling);
+		free_nodes.push_back(parent);
+		refit_up(grandparent);
+	}
+	return true;
+}
+
+template <typename T>
+void BVH<T>::finish_updates() {
+	if (parents.empty()) {
+		return; // never updated incrementally
+	}
+	max_depth = heights[0]; // already exact, kept by every edit
+	if (wide4.empty() && wide8.empty()) {
+		build_wide();
+	}
 }
 
 template <typename T>
 Intersection BVH<T>::locate(Ray& ray) {
-	return _locate(this->root, ray);
+	if (!wideq.empty()) {
+		return locate_wide(wideq, ray);
+	}
+	if (nodes.empty()) {
+		return NoIntersection;
+	}
+	if (!wide4.empty()) {
+		return locate_wide(wide4, ray);
+	}
+	if (!wide8.empty()) {
+		return locate_wide(wide8, ray);
+	}
+	return locate_binary(ray, 0);
 }
 
 template <typename T>
-Intersection BVH<T>::_locate(BVHNode<T>* node, Ray& ray) {
-	bool is_intersecting = node->check_intersection(ray);
+Intersection BVH<T>::locate_binary(Ray& ray, int start) {
+	struct StackEntry {
+		int idx;
+		float tentry; // re-checked when popped, the closest hit may have moved since the push
+	};
+	StackEntry stack_buf[BVH_STACK_SIZE];
+	std::vector<StackEntry> heap_stack;
+	StackEntry* stack = stack_buf;
+	if (max_depth + 1 >= BVH_STACK_SIZE) {
+		heap_stack.resize(max_depth + 2);
+		stack = heap_stack.data();
+	}
+
+	glm::vec3 inv_dir = 1.0f / ray.direction; // one division per axis for the whole traversal
+	float ray_tmax = ray.t_max;
+	float tmax = ray_tmax; // distance of the closest hit so far
+	Intersection closest = NoIntersection;
+	unsigned long long visited = 0, culled = 0, missed = 0, tested = 0;
+
+	int top = 0;
+	float tentry;
+	if (nodes[start].intersect(ray.origin, inv_dir, tentry)) {
+		stack[top++] = StackEntry{ start, tentry };
+	}
+	else {
+		missed++;
+	}
 
-	if (is_intersecting) {
-		if (node->is_leaf_node()) { // if leaf node
-			return node->obj->check_hit(ray); // object T needs to have CHECK_HIT function
+	while (top > 0) {
+		StackEntry entry = stack[--top];
+		if (entry.tentry > tmax) { // everything in this box is behind the closest hit
+			culled++;
+			continue;
+		}
+		const LinearBVHNode& node = nodes[entry.idx];
+		visited++;
+
+		if (node.is_leaf()) { // keep the nearest of its primitives
+			ray.t_max = tmax; // nested BVHs (mesh instances) prune against it too
+			hit_leaf(store, &prims[node.prim_offset()], node.prim_count(), ray, closest);
+			tmax = ray.t_max;
+			tested += node.prim_count();
+			continue;
 		}
-		else { // if intermediate
-			Intersection left_inter  = _locate(node->left, ray);
-			Intersection right_inter = _locate(node->right, ray);
 
-			// handle by cases
-			if (left_inter.hit_obj == nullptr && right_inter.hit_obj == nullptr) { // no hits
-				return NoIntersection;
+		// test both children, then visit the one the ray enters first
+		float t_left, t_right;
+		bool hit_left = nodes[node.left].intersect(ray.origin, inv_dir, t_left);
+		bool hit_right = nodes[node.right].intersect(ray.origin, inv_dir, t_right);
+		missed += !hit_left + !hit_right;
+		if (hit_left && t_left > tmax) { culled++; hit_left = false; }
+		if (hit_right && t_right > tmax) { culled++; hit_right = false; }
+
+		if (hit_left && hit_right) {
+			if (t_left <= t_right) { // push the far child first so the near one pops next
+				stack[top++] = StackEntry{ node.right, t_right };
+				stack[top++] = StackEntry{ node.left, t_left };
 			}
-			else if (left_inter.hit_obj != nullptr && right_inter.hit_obj != nullptr) { // both hit
-				return (left_inter.distance <= right_inter.distance) ? left_inter : right_inter;
+			else {
+				stack[top++] = StackEntry{ node.left, t_left };
+				stack[top++] = StackEntry{ node.right, t_right };
 			}
-			else if (left_inter.hit_obj != nullptr) {
-				return left_inter;
+		}
+		else if (hit_left) {
+			stack[top++] = StackEntry{ node.left, t_left };
+		}
+		else if (hit_right) {
+			stack[top++] = StackEntry{ node.right, t_right };
+		}
+	}
+	ray.t_max = ray_tmax;
+	record_stats(visited, culled, missed, tested, -1);
+	return closest; // hit_obj is NULL if nothing was hit
+}
+
+template <typename T>
+template <typename N>
+Intersection BVH<T>::locate_wide(const NodeArray<N>& wide, Ray& ray, int start) {
+	const int W = N::WIDTH;
+	struct StackEntry {
+		int child;
+		int count; // 0: wide node 'child'; > 0: leaf primitives starting at 'child'
+		float tentry;
+	};
+	// every level can leave W-1 siblings behind on the stack
+	int needed = max_depth * (W - 1) + 2;
+	StackEntry stack_buf[BVH_STACK_SIZE];
+	std::vector<StackEntry> heap_stack;
+	StackEntry* stack = stack_buf;
+	if (needed > BVH_STACK_SIZE) {
+		heap_stack.resize(needed);
+		stack = heap_stack.data();
+	}
+
+	WideRay wray(ray.origin, 1.0f / ray.direction);
+	float ray_tmax = ray.t_max;
+	float tmax = ray_tmax;
+	Intersection closest = NoIntersection;
+	unsigned long long visited = 0, culled = 0, missed = 0, tested = 0;
+
+	int top = 0;
+	stack[top++] = StackEntry{ start, 0, 0.0f }; // the start node's children are tested when it is opened
+	while (top > 0) {
+		StackEntry entry = stack[--top];
+		if (entry.tentry > tmax) {
+			culled++;
+			continue;
+		}
+		visited++;
+
+		if (entry.count > 0) {
+			ray.t_max = tmax;
+			hit_leaf(store, &prims[entry.child], entry.count, ray, closest);
+			tmax = ray.t_max;
+			tested += entry.count;
+			continue;
+		}
+
+		// all children in one go; boxes beyond tmax already come back as misses
+		const N& node = wide[entry.child];
+		float tnear[W];
+		int mask = intersect_children(node, wray, tmax, tnear);
+
+		// order the hit children far to near, so the nearest is popped first
+		int hit[W];
+		int n = 0;
+		for (int k = 0; k < W; k++) {
+			if (node.count[k] < 0) {
+				continue;
+			}
+			if (!(mask & (1 << k))) {
+				missed++;
+				continue;
+			}
+			int j = n++;
+			while (j > 0 && tnear[hit[j - 1]] < tnear[k]) {
+				hit[j] = hit[j - 1];
+				j--;
+			}
+			hit[j] = k;
+		}
+		for (int j = 0; j < n; j++) {
+			int k = hit[j];
+			stack[top++] = StackEntry{ node.child[k], node.count[k], tnear[k] };
+		}
+	}
+	ray.t_max = ray_tmax;
+	record_stats(visited, culled, missed, tested, -1);
+	return closest;
+}
+
+template <typename T>
+template <typename N>
+bool BVH<T>::occluded_wide(const NodeArray<N>& wide, Ray& ray, float tmax) {
+	const int W = N::WIDTH;
+	struct StackEntry {
+		int child;
+		int count;
+	};
+	int needed = max_depth * (W - 1) + 2;
+	StackEntry stack_buf[BVH_STACK_SIZE];
+	std::vector<StackEntry> heap_stack;
+	StackEntry* stack = stack_buf;
+	if (needed > BVH_STACK_SIZE) {
+		heap_stack.resize(needed);
+		stack = heap_stack.data();
+	}
+
+	WideRay wray(ray.origin, 1.0f / ray.direction);
+	float ray_tmax = ray.t_max;
+	ray.t_max = tmax;
+	bool blocked = false;
+	unsigned long long visited = 0, missed = 0, tested = 0;
+
+	int top = 0;
+	stack[top++] = StackEntry{ 0, 0 };
+	while (top > 0 && !blocked) {
+		StackEntry entry = stack[--top];
+		visited++;
+
+		if (entry.count > 0) {
+			tested += entry.count;
+			blocked = occluded_leaf(store, &prims[entry.child], entry.count, ray);
+			continue;
+		}
+
+		const N& node = wide[entry.child];
+		float tnear[W];
+		int mask = intersect_children(node, wray, tmax, tnear);
+		for (int k = 0; k < W; k++) {
+			if (node.count[k] < 0) {
+				continue;
+			}
+			if (mask & (1 << k)) {
+				stack[top++] = StackEntry{ node.child[k], node.count[k] };
 			}
 			else {
-				return right_inter;
+				missed++;
 			}
 		}
 	}
-	return NoIntersection; // ray.origin is dummy data, no intersection
+	ray.t_max = ray_tmax;
+	record_stats(visited, 0, missed, tested, blocked);
+	return blocked;
 }
 
 template <typename T>
-BVHNode<T>* BVH<T>::split_nodes(BVHNode<T>* r, std::vector<BVHNode<T>*> leaf) {
-	if (leaf.size() < 1) { // if no BVHNodes, end here
-		return NULL;
+void BVH<T>::locate_packet(RayPacket& packet, int mask) {
+	if (!wideq.empty()) { // no packet kernel for quantized nodes: ray by ray
+		for (int k = 0; k < PACKET_SIZE; k++) {
+			if (!(mask & (1 << k))) {
+				continue;
+			}
+			Ray r = packet.get_ray(k);
+			r.t_max = packet.t_max[k];
+			Intersection inter = locate_wide(wideq, r);
+			if (inter.hit_obj != nullptr && inter.distance < packet.t_max[k]) {
+				packet.hits[k] = inter;
+				packet.t_max[k] = inter.distance;
+			}
+		}
+		return;
 	}
-	if (leaf.size() == 1) { // if leaf node
-		r = leaf[0];
-		return r;
+	if (nodes.empty() || mask == 0) {
+		return;
+	}
+	if (!wide4.empty()) {
+		locate_packet_wide(wide4, packet, mask);
+		return;
+	}
+	if (!wide8.empty()) {
+		locate_packet_wide(wide8, packet, mask);
+		return;
 	}
 
-	// otherwise, create a new intermediate node here
-	r = new BVHNode<T>(static_cast<int> (leaf.size())); // this constructor keeps track of held objects
+	struct StackEntry {
+		int idx;
+		int mask; // rays that hit the parent
+	};
+	StackEntry stack_buf[BVH_STACK_SIZE];
+	std::vector<StackEntry> heap_stack;
+	StackEntry* stack = stack_buf;
+	if (max_depth + 1 >= BVH_STACK_SIZE) {
+		heap_stack.resize(max_depth + 2);
+		stack = heap_stack.data();
+	}
+
+	bool frustum = packet.common_origin && packet.same_signs;
+	unsigned long long visited = 0, culled = 0, missed = 0, tested = 0, splits = 0;
+
+	int top = 0;
+	stack[top++] = StackEntry{ 0, mask };
+	while (top > 0) {
+		StackEntry entry = stack[--top];
+		const LinearBVHNode& node = nodes[entry.idx];
+
+		// whole packet first: one test can reject the box for every ray
+		if (frustum) {
+			float tmax = 0.0f;
+			for (int k = 0; k < PACKET_SIZE; k++) {
+				if (entry.mask & (1 << k)) {
+					tmax = std::max(tmax, packet.t_max[k]);
+				}
+			}
+			if (!packet_may_hit_box(packet, node.bmin, node.bmax, tmax)) {
+				culled++;
+				continue;
+			}
+		}
+		float tnear[PACKET_SIZE];
+		int active = packet_box_mask(packet, node.bmin, node.bmax, entry.mask, tnear);
+		if (active == 0) {
+			missed++;
+			continue;
+		}
+		visited++;
+
+		if (mask_popcount(active) <= PACKET_SPLIT_RAYS && !node.is_leaf()) { // diverged, finish ray by ray
+			splits++;
+			for (int k = 0; k < PACKET_SIZE; k++) {
+				if (!(active & (1 << k))) {
+					continue;
+				}
+				Ray ray = packet.get_ray(k);
+				Intersection inter = locate_binary(ray, entry.idx);
+				if (inter.hit_obj != nullptr && inter.distance < packet.t_max[k]) {
+					packet.hits[k] = inter;
+					packet.t_max[k] = inter.distance;
+				}
+			}
+			continue;
+		}
 
-	// compute best SAH for current leaves, then get best splitting parameters (axis, pos)
-	int* params = min_SAH_params(leaf);
-	int best_axis = params[0];
-	int split_pos = params[1];
+		if (node.is_leaf()) {
+			hit_packet_leaf(store, &prims[node.prim_offset()], node.prim_count(), packet, active);
+			tested += node.prim_count();
+			continue;
+		}
 
-	// sort by best axis again to make sure split objects are aligned
-	std::sort(leaf.begin(), leaf.end(), [best_axis](const BVHNode<T>* a, const BVHNode<T>* b) {
-		// take centroids
-		glm::vec3 center1 = a->box.centroid();
-		glm::vec3 center2 = b->box.centroid();
-		return center1[best_axis] < center2[best_axis];
-		});
+		// near child on top, judged along one of the rays (they all point roughly the same way)
+		int k = mask_lowest(active);
+		const LinearBVHNode& l = nodes[node.left];
+		const LinearBVHNode& r = nodes[node.right];
+		float along = 0.0f;
+		for (int a = 0; a < 3; a++) {
+			along += ((l.bmin[a] + l.bmax[a]) - (r.bmin[a] + r.bmax[a])) * packet.dir[a][k];
+		}
+		if (along > 0.0f) { // left is farther
+			stack[top++] = StackEntry{ node.left, active };
+			stack[top++] = StackEntry{ node.right, active };
+		}
+		else {
+			stack[top++] = StackEntry{ node.right, active };
+			stack[top++] = StackEntry{ node.left, active };
+		}
+	}
+	record_packet_stats(visited, culled, missed, tested, splits);
+}
+
+template <typename T>
+template <int W>
+void BVH<T>::locate_packet_wide(const NodeArray<WideBVHNode<W>>& wide, RayPacket& packet, int mask) {
+	// as the binary packet traversal, but a popped entry is one child slot of a wide node: its box
+	// is tested for the whole packet when popped, against the t_max values of that moment
+	struct StackEntry {
+		int node; // wide node holding the child
+		int slot; // child slot in it; -1 opens 'node' itself (the root has no box to test)
+		int mask; // rays that hit the parent
+	};
+	int needed = max_depth * (W - 1) + 2;
+	StackEntry stack_buf[BVH_STACK_SIZE];
+	std::vector<StackEntry> heap_stack;
+	StackEntry* stack = stack_buf;
+	if (needed > BVH_STACK_SIZE) {
+		heap_stack.resize(needed);
+		stack = heap_stack.data();
+	}
+
+	bool frustum = packet.common_origin && packet.same_signs;
+	unsigned long long visited = 0, culled = 0, missed = 0, tested = 0, splits = 0;
+
+	int top = 0;
+	stack[top++] = StackEntry{ 0, -1, mask };
+	while (top > 0) {
+		StackEntry entry = stack[--top];
+		int open = entry.node;
+		int active = entry.mask;
+		if (entry.slot >= 0) {
+			const WideBVHNode<W>& parent = wide[entry.node];
+			int k = entry.slot;
+			float lo[3] = { parent.lo[0][k], parent.lo[1][k], parent.lo[2][k] };
+			float hi[3] = { parent.hi[0][k], parent.hi[1][k], parent.hi[2][k] };
+			if (frustum) {
+				float tmax = 0.0f;
+				for (int r = 0; r < PACKET_SIZE; r++) {
+					if (entry.mask & (1 << r)) {
+						tmax = std::max(tmax, packet.t_max[r]);
+					}
+				}
+				if (!packet_may_hit_box(packet, lo, hi, tmax)) {
+					culled++;
+					continue;
+				}
+			}
+			float tnear[PACKET_SIZE];
+			active = packet_box_mask(packet, lo, hi, entry.mask, tnear);
+			if (active == 0) {
+				missed++;
+				continue;
+			}
+			visited++;
 
-	// once we have the minimum SAH score + parameters, we can actually split
-	std::vector<BVHNode<T>*> left_nodes(leaf.begin(), leaf.begin() + split_pos + 1); // left leaf objects
-	std::vector<BVHNode<T>*> right_nodes(leaf.begin() + split_pos + 1, leaf.end()); // right leaf objects
+			if (parent.count[k] > 0) {
+				hit_packet_leaf(store, &prims[parent.child[k]], parent.count[k], packet, active);
+				tested += parent.count[k];
+				continue;
+			}
+			open = parent.child[k];
+			if (mask_popcount(active) <= PACKET_SPLIT_RAYS) { // diverged, finish ray by ray
+				splits++;
+				for (int r = 0; r < PACKET_SIZE; r++) {
+					if (!(active & (1 << r))) {
+						continue;
+					}
+					Ray ray = packet.get_ray(r);
+					Intersection inter = locate_wide(wide, ray, open);
+					if (inter.hit_obj != nullptr && inter.distance < packet.t_max[r]) {
+						packet.hits[r] = inter;
+						packet.t_max[r] = inter.distance;
+					}
+				}
+				continue;
+			}
+		}
 
-	// recursively create new nodes for split objects
-	r->left = split_nodes(r->left, left_nodes);
-	std::cout << "left done, " << r->left << '\n';
-	r->right = split_nodes(r->right, right_nodes);
-	std::cout << "right done, " << r->right << '\n';
+		// push the children far to near along one of the rays, so the nearest is popped first
+		const WideBVHNode<W>& node = wide[open];
+		int r = mask_lowest(active);
+		float along[W];
+		int order[W];
+		int n = 0;
+		for (int k = 0; k < W; k++) {
+			if (node.count[k] < 0) {
+				continue;
+			}
+			along[k] = 0.0f;
+			for (int a = 0; a < 3; a++) {
+				along[k] += (node.lo[a][k] + node.hi[a][k]) * packet.dir[a][r];
+			}
+			int j = n++;
+			while (j > 0 && along[order[j - 1]] < along[k]) {
+				order[j] = order[j - 1];
+				j--;
+			}
+			order[j] = k;
+		}
+		for (int j = 0; j < n; j++) {
+			stack[top++] = StackEntry{ open, order[j], active };
+		}
+	}
+	record_packet_stats(visited, culled, missed, tested, splits);
+}
 
-	// once we've computed left and right subtrees, fill in data for THIS node
-		// - calculate parent (this) bounding box
+template <typename T>
+void BVH<T>::record_stats(unsigned long long visited, unsigned long long culled, unsigned long long missed,
+	unsigned long long tested, int occlusion) {
+#if BVH_STATS
+	stats.queries.fetch_add(1, std::memory_order_relaxed);
+	if (occlusion >= 0) {
+		stats.occlusion_queries.fetch_add(1, std::memory_order_relaxed);
+		stats.occlusion_hits.fetch_add(occlusion, std::memory_order_relaxed);
+	}
+	stats.nodes_visited.fetch_add(visited, std::memory_order_relaxed);
+	stats.nodes_culled.fetch_add(culled, std::memory_order_relaxed);
+	stats.nodes_missed.fetch_add(missed, std::memory_order_relaxed);
+	stats.prims_tested.fetch_add(tested, std::memory_order_relaxed);
+#else
+	(void)visited; (void)culled; (void)missed; (void)tested; (void)occlusion; // counters not compiled in
+#endif
+}
+
+template <typename T>
+void BVH<T>::record_packet_stats(unsigned long long visited, unsigned long long culled, unsigned long long missed,
+	unsigned long long tested, unsigned long long splits) {
+#if BVH_STATS
+	stats.packets.fetch_add(1, std::memory_order_relaxed);
+	stats.packet_splits.fetch_add(splits, std::memory_order_relaxed);
+	stats.nodes_visited.fetch_add(visited, std::memory_order_relaxed);
+	stats.nodes_culled.fetch_add(culled, std::memory_order_relaxed);
+	stats.nodes_missed.fetch_add(missed, std::memory_order_relaxed);
+	stats.prims_tested.fetch_add(tested, std::memory_order_relaxed);
+#else
+	(void)visited; (void)culled; (void)missed; (void)tested; (void)splits;
+#endif
+}
 
-	if (r->left != NULL && r->right != NULL) {
-		r->box.c1 = vec3_get_extremes(r->left->box.c1, r->right->box.c1, false); // minimum
-		r->box.c2 = vec3_get_extremes(r->left->box.c2, r->right->box.c2, true);  // maximum
+template <typename T>
+bool BVH<T>::occluded(Ray& ray, float tmax) {
+	if (!wideq.empty()) {
+		return occluded_wide(wideq, ray, tmax);
 	}
-	else {
-		std::cout << "BVH::ERROR: split_nodes has only ONE child; this should not be possible.\n";
+	if (nodes.empty()) {
+		return false;
+	}
+	if (!wide4.empty()) {
+		return occluded_wide(wide4, ray, tmax);
+	}
+	if (!wide8.empty()) {
+		return occluded_wide(wide8, ray, tmax);
 	}
 
-	return r;
+	// no ordering and no closest hit to track: the first blocker ends the query
+	int stack_buf[BVH_STACK_SIZE];
+	std::vector<int> heap_stack;
+	int* stack = stack_buf;
+	if (max_depth + 1 >= BVH_STACK_SIZE) {
+		heap_stack.resize(max_depth + 2);
+		stack = heap_stack.data();
+	}
+
+	glm::vec3 inv_dir = 1.0f / ray.direction;
+	float ray_tmax = ray.t_max;
+	ray.t_max = tmax;
+	bool blocked = false;
+	unsigned long long visited = 0, culled = 0, missed = 0, tested = 0;
+
+	int top = 0;
+	stack[top++] = 0;
+	while (top > 0 && !blocked) {
+		const LinearBVHNode& node = nodes[stack[--top]];
+		float tentry;
+		if (!node.intersect(ray.origin, inv_dir, tentry)) {
+			missed++;
+			continue;
+		}
+		if (tentry > tmax) { // box starts past the light
+			culled++;
+			continue;
+		}
+		visited++;
+
+		if (node.is_leaf()) {
+			tested += node.prim_count();
+			blocked = occluded_leaf(store, &prims[node.prim_offset()], node.prim_count(), ray);
+			continue;
+		}
+		stack[top++] = node.right;
+		stack[top++] = node.left;
+	}
+	ray.t_max = ray_tmax;
+	record_stats(visited, culled, missed, tested, blocked);
+	return blocked;
+}
+
+template <typename T>
+void BVH<T>::print_traversal_stats(const char* label) {
+#if BVH_STATS
+	unsigned long long q = stats.queries.load();
+	std::cout << "[BVH] " << label << ": " << q << " queries (" << stats.occlusion_queries.load() << " any-hit, "
+		<< stats.occlusion_hits.load() << " blocked), " << stats.nodes_visited.load() << " nodes visited, "
+		<< stats.nodes_culled.load() << " culled by tmax, " << stats.nodes_missed.load() << " missed, "
+		<< stats.prims_tested.load() << " primitive tests, " << stats.packets.load() << " packets ("
+		<< stats.packet_splits.load() << " split)";
+	if (q > 0) {
+		std::cout << " (" << static_cast<double>(stats.nodes_visited.load()) / q << " nodes/query)";
+	}
+	std::cout << "\n";
+#else
+	std::cout << "[BVH] " << label << ": traversal counters not compiled in (build with BVH_STATS 1)\n";
+#endif
+}
+
+template <typename T>
+void BVH<T>::reset_traversal_stats() {
+	stats.queries = 0;
+	stats.nodes_visited = 0;
+	stats.nodes_culled = 0;
+	stats.nodes_missed = 0;
+	stats.prims_tested = 0;
+	stats.occlusion_queries = 0;
+	stats.occlusion_hits = 0;
+	stats.packets = 0;
+	stats.packet_splits = 0;
 }
 
 template <typename T>
 BVHNode<T>::BVHNode(int total_objs) {
 	left = nullptr;
 	right = nullptr;
-	obj = nullptr;
+	first_prim = -1;
 	held_objects = total_objs;
 }
 
 // for leaf node
 template <typename T>
-BVHNode<T>::BVHNode(glm::vec3 min_xyz, glm::vec3 max_xyz, T obj) {
-	BoundingBox b(min_xyz, max_xyz); // corner1, corner2
-	this->box = b;
-	this->obj = obj;
+BVHNode<T>::BVHNode(const BoundingBox& box, int first, int count) {
+	this->box = box;
 	left = nullptr;
 	right = nullptr;
-	held_objects = 1;
+	first_prim = first;
+	held_objects = count;
 }
 
 template <typename T>
@@ -314,17 +2084,16 @@ bool BVHNode<T>::is_leaf_node() const {
 	return false;
 }
 
-template <typename T> 
-bool BVHNode<T>::check_intersection(Ray& r) {
+inline bool LinearBVHNode::intersect(const glm::vec3& origin, const glm::vec3& inv_dir, float& tentry) const {
 	// Initialize tmin and tmax to very large and very small values respectively
 	float tmin = 0.0f;
 	float tmax = INT_MAX;
 
 	// Iterate over the 3 axes (x, y, z)
 	for (int i = 0; i < 3; i++) {
-		float invD = 1.0f / r.direction[i];
-		float t0 = (this->box.c1[i] - r.origin[i]) * invD;
-		float t1 = (this->box.c2[i] - r.origin[i]) * invD;
+		float invD = inv_dir[i];
+		float t0 = (bmin[i] - origin[i]) * invD;
+		float t1 = (bmax[i] - origin[i]) * invD;
 
 		// Swap t0 and t1 if the ray is traveling in the negative direction of the axis
 		if (invD < 0.0f) std::swap(t0, t1);
@@ -339,46 +2108,80 @@ bool BVHNode<T>::check_intersection(Ray& r) {
 		}
 	}
 
+	tentry = tmin;
 	return true;
 }
 
 template <typename T>
 void BVH<T>::display() {
-	if (this->root == nullptr) {
+	if (!wideq.empty()) {
+		print_summary("quantized"); // no binary nodes left to print
+		return;
+	}
+	if (nodes.empty()) {
 		std::cout << "BVH is empty.\n";
 		return;
 	}
-	_display(root);
+	std::cout << "[BVH] " << nodes.size() << " nodes, " << prims.size() << " primitives, "
+		<< nodes.size() * sizeof(LinearBVHNode) << " bytes, built in " << build_ms << " ms\n";
+	_display(0, 0);
 }
 
 template <typename T>
-void BVH<T>::_display(BVHNode<T>* r) {
-	if (r == nullptr) {
-		return;
+void BVH<T>::print_summary(const char* label) {
+	std::cout << "[BVH] " << label << ": " << prim_count() - split_refs << " primitives, ";
+	if (!wideq.empty()) {
+		std::cout << wideq.size() << " quantized 4-wide nodes";
+	}
+	else {
+		std::cout << node_count() << " nodes";
+	}
+	if (split_refs > 0) {
+		std::cout << " (+" << split_refs << " split references)";
 	}
+	if (!wide4.empty() || !wide8.empty()) {
+		std::cout << " (" << (wide4.empty() ? wide8.size() : wide4.size()) << " " << options.width << "-wide)";
+	}
+	size_t node_bytes = nodes.capacity() * sizeof(LinearBVHNode) + wide4.capacity() * sizeof(WideBVHNode<4>)
+		+ wide8.capacity() * sizeof(WideBVHNode<8>) + wideq.capacity() * sizeof(QuantizedBVHNode);
+	std::cout << ", " << node_bytes / 1024 << " KB of nodes";
+	std::cout << ", built in " << build_ms << " ms\n";
+}
 
-	glm::vec3 center = r->box.centroid();
+template <typename T>
+void BVH<T>::_display(int idx, int depth) {
+	const LinearBVHNode& n = nodes[idx];
+	BoundingBox box(glm::vec3(n.bmin[0], n.bmin[1], n.bmin[2]), glm::vec3(n.bmax[0], n.bmax[1], n.bmax[2]));
 
 	// Print the current node's value
-	std::cout << "[count below:" << r->held_objects << "]address: " << r << " || : ";
-	std::cout << r->box.surface_area() << "\n"; // check that parent boxes are bigger
-
-	// Traverse left subtree
-	_display(r->left);
+	std::cout << std::string(depth, ' ') << "[node " << idx << "] ";
+	if (n.is_leaf()) {
+		std::cout << "leaf, prims " << n.prim_offset() << "+" << n.prim_count() << " || : ";
+	}
+	else {
+		std::cout << "children (" << n.left << ", " << n.right << ") || : ";
+	}
+	std::cout << box.surface_area() << "\n"; // check that parent boxes are bigger
 
-	// Traverse right subtree
-	_display(r->right);
+	if (!n.is_leaf()) {
+		_display(n.left, depth + 1);  // Traverse left subtree
+		_display(n.right, depth + 1); // Traverse right subtree
+	}
 }
 
 template <typename T>
 void BVH<T>::cleanup() {
 	_cleanup(this->root);
+	root = nullptr;
 }
 
 template <typename T>
 void BVH<T>::_cleanup(BVHNode<T>* r) {
-	_display(r->left);
-	_display(r->right);
+	if (r == nullptr) {
+		return;
+	}
+	_cleanup(r->left);
+	_cleanup(r->right);
 
 	// delete from bottom up
 	delete r;
@@ -387,4 +2190,4 @@ void BVH<T>::_cleanup(BVHNode<T>* r) {
 template <typename T>
 BVH<T>::~BVH() {
 	cleanup();
-}
\ No newline at end of file
+}
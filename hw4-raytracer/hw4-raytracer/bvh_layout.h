@@ -0,0 +1,169 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <deque>
+#include <new>
+#include <type_traits>
+#include <vector>
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+// Order of the node arrays in memory. Traversal follows child indices, so any order works;
+// the layouts only change how many cache lines and pages a traversal touches.
+enum BVHNodeLayout {
+	BVH_LAYOUT_DEPTH_FIRST, // as flattened: a left child right after its parent
+	BVH_LAYOUT_VEB,         // van Emde Boas: recursively the top half of the levels, then each subtree below it
+	BVH_LAYOUT_TREELET,     // breadth-first clusters of BVH_TREELET_BYTES, subtrees' clusters after their parent's
+};
+
+const size_t BVH_NODE_ALIGNMENT = 64;            // node arrays start on a cache line
+const size_t BVH_HOT_BYTES = 4096;               // top nodes packed together first (treelet layout)
+const size_t BVH_TREELET_BYTES = 256;            // one cluster: a few adjacent lines, fetched together by the prefetcher
+const size_t BVH_HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+// Node array storage: cache-line aligned, and optionally backed by huge pages (arrays of at
+// least one huge page are aligned to it and advised as such; Linux transparent huge pages,
+// a no-op elsewhere). The flag is per array and travels with it on swap/move.
+template <typename N>
+class NodeAllocator {
+public:
+	typedef N value_type;
+	typedef std::true_type propagate_on_container_move_assignment;
+	typedef std::true_type propagate_on_container_swap;
+	typedef std::true_type propagate_on_container_copy_assignment;
+
+	bool huge_pages = false;
+
+	NodeAllocator() = default;
+	explicit NodeAllocator(bool huge) : huge_pages(huge) {}
+	template <typename M>
+	NodeAllocator(const NodeAllocator<M>& other) : huge_pages(other.huge_pages) {}
+
+	N* allocate(size_t n) {
+		size_t bytes = n * sizeof(N);
+		size_t align = (huge_pages && bytes >= BVH_HUGE_PAGE_SIZE) ? BVH_HUGE_PAGE_SIZE : BVH_NODE_ALIGNMENT;
+		void* p = operator new[](bytes, std::align_val_t(align));
+#ifdef __linux__
+		if (align == BVH_HUGE_PAGE_SIZE) {
+			madvise(p, bytes / BVH_HUGE_PAGE_SIZE * BVH_HUGE_PAGE_SIZE, MADV_HUGEPAGE);
+		}
+#endif
+		return static_cast<N*>(p);
+	}
+	void deallocate(N* p, size_t n) {
+		size_t bytes = n * sizeof(N);
+		size_t align = (huge_pages && bytes >= BVH_HUGE_PAGE_SIZE) ? BVH_HUGE_PAGE_SIZE : BVH_NODE_ALIGNMENT;
+		operator delete[](p, std::align_val_t(align));
+	}
+	template <typename M>
+	bool operator==(const NodeAllocator<M>& other) const { return huge_pages == other.huge_pages; }
+	template <typename M>
+	bool operator!=(const NodeAllocator<M>& other) const { return huge_pages != other.huge_pages; }
+};
+
+template <typename N>
+using NodeArray = std::vector<N, NodeAllocator<N>>;
+
+// New order of a tree's nodes for 'layout': order[k] is the old index of the node stored at k.
+// Only nodes reachable from the root (old index 0) are listed, and the root stays first.
+// children(idx, out) writes the inner children of node idx to out and returns how many.
+template <typename ChildrenFn>
+std::vector<int> bvh_layout_order(int node_count, ChildrenFn children, BVHNodeLayout layout, size_t node_bytes) {
+	std::vector<int> order;
+	if (node_count == 0) {
+		return order;
+	}
+	order.reserve(node_count);
+	int kids[8];
+
+	if (layout == BVH_LAYOUT_DEPTH_FIRST) {
+		std::vector<int> stack(1, 0);
+		while (!stack.empty()) {
+			int idx = stack.back();
+			stack.pop_back();
+			order.push_back(idx);
+			int n = children(idx, kids);
+			for (int k = n - 1; k >= 0; k--) {
+				stack.push_back(kids[k]);
+			}
+		}
+		return order;
+	}
+
+	if (layout == BVH_LAYOUT_TREELET) {
+		// clusters grow breadth-first from their root; children left over start clusters of their own,
+		// which follow their parent's cluster depth-first. The first cluster is bigger: the top levels
+		// every ray walks through sit in one page.
+		size_t cluster = std::max<size_t>(1, BVH_TREELET_BYTES / node_bytes);
+		size_t hot = std::max<size_t>(cluster, BVH_HOT_BYTES / node_bytes);
+		std::vector<int> roots(1, 0);
+		std::deque<int> queue;
+		std::vector<int> spill;
+		while (!roots.empty()) {
+			int root = roots.back();
+			roots.pop_back();
+			size_t limit = order.empty() ? hot : cluster;
+			queue.assign(1, root);
+			for (size_t taken = 0; !queue.empty() && taken < limit; taken++) {
+				int idx = queue.front();
+				queue.pop_front();
+				order.push_back(idx);
+				int n = children(idx, kids);
+				queue.insert(queue.end(), kids, kids + n);
+			}
+			spill.assign(queue.begin(), queue.end());
+			roots.insert(roots.end(), spill.rbegin(), spill.rend()); // leftmost cluster next
+		}
+		return order;
+	}
+
+	// van Emde Boas: heights first (children come after their parent in breadth-first order)
+	std::vector<int> bfs(1, 0);
+	for (size_t k = 0; k < bfs.size(); k++) {
+		int n = children(bfs[k], kids);
+		bfs.insert(bfs.end(), kids, kids + n);
+	}
+	std::vector<int> height(node_count, 1);
+	for (int k = static_cast<int>(bfs.size()) - 1; k >= 0; k--) {
+		int n = children(bfs[k], kids);
+		for (int c = 0; c < n; c++) {
+			height[bfs[k]] = std::max(height[bfs[k]], height[kids[c]] + 1);
+		}
+	}
+
+	// lay out 'levels' levels below 'root': the top half recursively, then every subtree hanging
+	// below it; nodes deeper than 'levels' are left to the caller
+	struct Frame {
+		int root;
+		int levels;
+	};
+	std::vector<Frame> work(1, Frame{ 0, height[0] });
+	std::vector<int> frontier, next;
+	while (!work.empty()) {
+		Frame f = work.back();
+		work.pop_back();
+		int levels = std::min(f.levels, height[f.root]);
+		if (levels == 1) {
+			order.push_back(f.root);
+			continue;
+		}
+		int top = levels / 2;
+		frontier.assign(1, f.root);
+		for (int d = 0; d < top; d++) { // nodes 'top' levels down, left to right
+			next.clear();
+			for (int idx : frontier) {
+				int n = children(idx, kids);
+				next.insert(next.end(), kids, kids + n);
+			}
+			frontier.swap(next);
+		}
+		// stack: pushed in reverse, so the top part is laid out first, then the subtrees left to right
+		for (int k = static_cast<int>(frontier.size()) - 1; k >= 0; k--) {
+			work.push_back(Frame{ frontier[k], levels - top });
+		}
+		work.push_back(Frame{ f.root, top });
+	}
+	return order;
+}
@@ -0,0 +1,293 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include "ray.h"
+
+// Box-test kernels for wide (4/8-ary) BVH nodes and for ray packets.
+// BVH_SIMD picks the instruction set at compile time: 2 = AVX2, 1 = SSE2, 0 = scalar loops.
+// Define it before including bvh.h to force a path (e.g. BVH_SIMD 0 to compare against scalar).
+#ifndef BVH_SIMD
+#if defined(__AVX2__)
+#define BVH_SIMD 2
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define BVH_SIMD 1
+#else
+#define BVH_SIMD 0
+#endif
+#endif
+
+#if BVH_SIMD > 0
+#include <immintrin.h>
+#endif
+
+// widest node the build options accept; 2 keeps plain binary traversal
+#if BVH_SIMD == 2
+const int BVH_DEFAULT_WIDTH = 8;
+#elif BVH_SIMD == 1
+const int BVH_DEFAULT_WIDTH = 4;
+#else
+const int BVH_DEFAULT_WIDTH = 2;
+#endif
+
+// W children per node, bounds stored per axis (SoA) so one instruction covers every child.
+// Empty slots get an inverted box that no ray can hit, so the kernels never need a lane mask.
+template <int W>
+struct alignas(32) WideBVHNode {
+	static const int WIDTH = W;
+	float lo[3][W]; // lo[axis][child]
+	float hi[3][W];
+	int child[W]; // inner child: index of its wide node; leaf child: first primitive
+	int count[W]; // 0: inner child, > 0: leaf with that many primitives, -1: empty slot
+
+	void clear_slot(int k) {
+		for (int a = 0; a < 3; a++) {
+			lo[a][k] = FLT_MAX;
+			hi[a][k] = -FLT_MAX;
+		}
+		child[k] = 0;
+		count[k] = -1;
+	}
+};
+
+static_assert(sizeof(WideBVHNode<4>) == 128, "4-wide node should be two cache lines");
+static_assert(sizeof(WideBVHNode<8>) == 256, "8-wide node should be four cache lines");
+
+// 4-wide node in one cache line: child boxes are 8-bit grid coordinates inside the node's own box,
+// corner = origin + q * 2^exponent per axis (a power of two scale, so decoding is exact up to the
+// final add). Built conservatively: the decoded box always contains the real one.
+struct alignas(64) QuantizedBVHNode {
+	static const int WIDTH = 4;
+	float origin[3];
+	int8_t exponent[3];
+	int8_t count[4]; // as WideBVHNode: 0 inner, > 0 leaf primitives (at most 127), -1 empty
+	uint8_t unused;
+	uint8_t qlo[3][4]; // qlo[axis][child], rounded down
+	uint8_t qhi[3][4]; // rounded up
+	int child[4];
+	int spare;
+};
+
+static_assert(sizeof(QuantizedBVHNode) == 64, "quantized node should be one cache line");
+
+inline float quantized_scale(int8_t exponent) {
+	return std::ldexp(1.0f, exponent);
+}
+
+// child boxes back to floats (same arithmetic on every path, so SIMD and scalar agree bit for bit)
+inline void decode_children(const QuantizedBVHNode& n, WideBVHNode<4>& out) {
+	for (int a = 0; a < 3; a++) {
+		float scale = quantized_scale(n.exponent[a]);
+#if BVH_SIMD > 0
+		__m128i zero = _mm_setzero_si128();
+		__m128i lo, hi;
+		int packed;
+		std::memcpy(&packed, n.qlo[a], 4);
+		lo = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(packed), zero), zero);
+		std::memcpy(&packed, n.qhi[a], 4);
+		hi = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(packed), zero), zero);
+		__m128 org = _mm_set1_ps(n.origin[a]);
+		__m128 sc = _mm_set1_ps(scale);
+		_mm_storeu_ps(out.lo[a], _mm_add_ps(org, _mm_mul_ps(_mm_cvtepi32_ps(lo), sc)));
+		_mm_storeu_ps(out.hi[a], _mm_add_ps(org, _mm_mul_ps(_mm_cvtepi32_ps(hi), sc)));
+#else
+		for (int k = 0; k < 4; k++) {
+			out.lo[a][k] = n.origin[a] + static_cast<float>(n.qlo[a][k]) * scale;
+			out.hi[a][k] = n.origin[a] + static_cast<float>(n.qhi[a][k]) * scale;
+		}
+#endif
+	}
+}
+
+// per-query ray data shared by every node test
+struct WideRay {
+	float org[3];
+	float inv_dir[3];
+	int neg[3]; // direction negative on this axis: the near plane is 'hi'
+
+	WideRay(const glm::vec3& origin, const glm::vec3& inv) {
+		for (int a = 0; a < 3; a++) {
+			org[a] = origin[a];
+			inv_dir[a] = inv[a];
+			neg[a] = inv[a] < 0.0f;
+		}
+	}
+};
+
+// Slab test of all children of 'n' against [0, tmax]. Returns a bit mask of the children hit
+// and writes every child's entry distance to tnear (only meaningful for set bits).
+template <int W>
+inline int intersect_children_scalar(const WideBVHNode<W>& n, const WideRay& r, float tmax, float* tnear) {
+	int mask = 0;
+	for (int k = 0; k < W; k++) {
+		float t0 = 0.0f;
+		float t1 = tmax;
+		for (int a = 0; a < 3; a++) {
+			float near_plane = r.neg[a] ? n.hi[a][k] : n.lo[a][k];
+			float far_plane = r.neg[a] ? n.lo[a][k] : n.hi[a][k];
+			t0 = std::max(t0, (near_plane - r.org[a]) * r.inv_dir[a]);
+			t1 = std::min(t1, (far_plane - r.org[a]) * r.inv_dir[a]);
+		}
+		tnear[k] = t0;
+		mask |= (t0 <= t1) << k;
+	}
+	return mask;
+}
+
+#if BVH_SIMD > 0
+// four children at a time, from any four consecutive slots
+inline int intersect_children_sse(const float* lo, const float* hi, int stride, const WideRay& r, float tmax, float* tnear) {
+	__m128 t0 = _mm_setzero_ps();
+	__m128 t1 = _mm_set1_ps(tmax);
+	for (int a = 0; a < 3; a++) {
+		const float* near_plane = (r.neg[a] ? hi : lo) + a * stride;
+		const float* far_plane = (r.neg[a] ? lo : hi) + a * stride;
+		__m128 org = _mm_set1_ps(r.org[a]);
+		__m128 inv = _mm_set1_ps(r.inv_dir[a]);
+		// new value first: for a ray lying in a slab plane (0 * inf = NaN) max/min return the old bound
+		t0 = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(near_plane), org), inv), t0);
+		t1 = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(far_plane), org), inv), t1);
+	}
+	_mm_storeu_ps(tnear, t0);
+	return _mm_movemask_ps(_mm_cmple_ps(t0, t1));
+}
+#endif
+
+inline int intersect_children(const WideBVHNode<4>& n, const WideRay& r, float tmax, float* tnear) {
+#if BVH_SIMD > 0
+	return intersect_children_sse(&n.lo[0][0], &n.hi[0][0], 4, r, tmax, tnear);
+#else
+	return intersect_children_scalar(n, r, tmax, tnear);
+#endif
+}
+
+inline int intersect_children(const QuantizedBVHNode& n, const WideRay& r, float tmax, float* tnear) {
+	WideBVHNode<4> boxes; // only lo/hi are filled
+	decode_children(n, boxes);
+	return intersect_children(boxes, r, tmax, tnear);
+}
+
+inline int intersect_children(const WideBVHNode<8>& n, const WideRay& r, float tmax, float* tnear) {
+#if BVH_SIMD == 2
+	__m256 t0 = _mm256_setzero_ps();
+	__m256 t1 = _mm256_set1_ps(tmax);
+	for (int a = 0; a < 3; a++) {
+		const float* near_plane = r.neg[a] ? n.hi[a] : n.lo[a];
+		const float* far_plane = r.neg[a] ? n.lo[a] : n.hi[a];
+		__m256 org = _mm256_set1_ps(r.org[a]);
+		__m256 inv = _mm256_set1_ps(r.inv_dir[a]);
+		t0 = _mm256_max_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(near_plane), org), inv), t0);
+		t1 = _mm256_min_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(far_plane), org), inv), t1);
+	}
+	_mm256_storeu_ps(tnear, t0);
+	return _mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ));
+#elif BVH_SIMD == 1
+	// no 8-lane registers: two 4-lane halves
+	int mask = intersect_children_sse(&n.lo[0][0], &n.hi[0][0], 8, r, tmax, tnear);
+	return mask | (intersect_children_sse(&n.lo[0][4], &n.hi[0][4], 8, r, tmax, tnear + 4) << 4);
+#else
+	return intersect_children_scalar(n, r, tmax, tnear);
+#endif
+}
+
+////////////////////////////// ray packets ////////////////////////////////
+
+inline int mask_popcount(int mask) {
+	int n = 0;
+	for (; mask != 0; mask &= mask - 1) {
+		n++;
+	}
+	return n;
+}
+
+inline int mask_lowest(int mask) { // index of the lowest set bit, mask must not be 0
+	int k = 0;
+	while (!(mask & (1 << k))) {
+		k++;
+	}
+	return k;
+}
+
+// Frustum test for packets with one origin and one direction sign per axis (camera rays):
+// interval bounds over all directions give the earliest entry and latest exit any ray could have.
+// Returns false only when no ray of the packet can hit the box before tmax.
+inline bool packet_may_hit_box(const RayPacket& p, const float lo[3], const float hi[3], float tmax) {
+	float tenter = 0.0f;
+	float texit = tmax;
+	for (int a = 0; a < 3; a++) {
+		bool neg = p.inv_max[a] < 0.0f;
+		float near_offset = (neg ? hi[a] : lo[a]) - p.org[a][0];
+		float far_offset = (neg ? lo[a] : hi[a]) - p.org[a][0];
+		tenter = std::max(tenter, std::min(near_offset * p.inv_min[a], near_offset * p.inv_max[a]));
+		texit = std::min(texit, std::max(far_offset * p.inv_min[a], far_offset * p.inv_max[a]));
+	}
+	return tenter <= texit;
+}
+
+// Slab test of every ray in 'mask' against one box, each against its own t_max.
+// Returns the rays that hit; tnear gets their entry distances.
+inline int packet_box_mask(const RayPacket& p, const float lo[3], const float hi[3], int mask, float* tnear) {
+	int result = 0;
+#if BVH_SIMD == 2
+	for (int g = 0; g < PACKET_SIZE; g += 8) {
+		if (((mask >> g) & 0xFF) == 0) {
+			continue;
+		}
+		__m256 t0 = _mm256_setzero_ps();
+		__m256 t1 = _mm256_loadu_ps(&p.t_max[g]);
+		for (int a = 0; a < 3; a++) {
+			__m256 org = _mm256_loadu_ps(&p.org[a][g]);
+			__m256 inv = _mm256_loadu_ps(&p.inv_dir[a][g]);
+			// per-ray near/far plane by direction sign, then NaN-tolerant max/min as in the wide kernels
+			__m256 neg = _mm256_cmp_ps(inv, _mm256_setzero_ps(), _CMP_LT_OQ);
+			__m256 near_plane = _mm256_blendv_ps(_mm256_set1_ps(lo[a]), _mm256_set1_ps(hi[a]), neg);
+			__m256 far_plane = _mm256_blendv_ps(_mm256_set1_ps(hi[a]), _mm256_set1_ps(lo[a]), neg);
+			t0 = _mm256_max_ps(_mm256_mul_ps(_mm256_sub_ps(near_plane, org), inv), t0);
+			t1 = _mm256_min_ps(_mm256_mul_ps(_mm256_sub_ps(far_plane, org), inv), t1);
+		}
+		_mm256_storeu_ps(tnear + g, t0);
+		result |= _mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ)) << g;
+	}
+#elif BVH_SIMD == 1
+	for (int g = 0; g < PACKET_SIZE; g += 4) {
+		if (((mask >> g) & 0xF) == 0) {
+			continue;
+		}
+		__m128 t0 = _mm_setzero_ps();
+		__m128 t1 = _mm_loadu_ps(&p.t_max[g]);
+		for (int a = 0; a < 3; a++) {
+			__m128 org = _mm_loadu_ps(&p.org[a][g]);
+			__m128 inv = _mm_loadu_ps(&p.inv_dir[a][g]);
+			__m128 neg = _mm_cmplt_ps(inv, _mm_setzero_ps());
+			__m128 l = _mm_set1_ps(lo[a]);
+			__m128 h = _mm_set1_ps(hi[a]);
+			__m128 near_plane = _mm_or_ps(_mm_and_ps(neg, h), _mm_andnot_ps(neg, l)); // SSE2 select
+			__m128 far_plane = _mm_or_ps(_mm_and_ps(neg, l), _mm_andnot_ps(neg, h));
+			t0 = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(near_plane, org), inv), t0);
+			t1 = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(far_plane, org), inv), t1);
+		}
+		_mm_storeu_ps(tnear + g, t0);
+		result |= _mm_movemask_ps(_mm_cmple_ps(t0, t1)) << g;
+	}
+#else
+	for (int k = 0; k < PACKET_SIZE; k++) {
+		if (!(mask & (1 << k))) {
+			continue;
+		}
+		float t0 = 0.0f;
+		float t1 = p.t_max[k];
+		for (int a = 0; a < 3; a++) {
+			bool neg = p.inv_dir[a][k] < 0.0f;
+			t0 = std::max(t0, ((neg ? hi[a] : lo[a]) - p.org[a][k]) * p.inv_dir[a][k]);
+			t1 = std::min(t1, ((neg ? lo[a] : hi[a]) - p.org[a][k]) * p.inv_dir[a][k]);
+		}
+		tnear[k] = t0;
+		result |= (t0 <= t1) << k;
+	}
+#endif
+	return result & mask;
+}
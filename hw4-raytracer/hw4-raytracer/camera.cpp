@@ -103,10 +103,12 @@ glm::mat4 Camera::vp() {
 
 void Camera::rotate_left(float degrees) {
 	Transform::left(degrees, pos, up);
+	version++;
 }
 
 void Camera::rotate_up(float degrees) {
 	Transform::up(degrees, pos, up);
+	version++;
 }
 
 Ray Camera::ray_for_pixel(int i, int j) {
@@ -126,4 +128,23 @@ Ray Camera::ray_for_pixel(int i, int j) {
 
 	dir = glm::normalize((alpha * u + beta * v - w));
 	return Ray(origin, dir);
+}
+
+void Camera::rays_for_block(int row0, int col0, int row1, int col1, RayPacket& packet) {
+	// same rays as ray_for_pixel, with the frame computed once per block
+	glm::vec3 w = glm::normalize(pos - center);
+	glm::vec3 u = glm::normalize(glm::cross(up, w));
+	glm::vec3 v = glm::cross(w, u);
+	float tan_half = glm::tan(glm::radians(fov) / 2.0f);
+	float aspect = get_aspect_ratio();
+
+	packet.count = 0;
+	for (int i = row0; i < row1; i++) {
+		float beta = tan_half * (1 - (i / (height / 2.0f)));
+		for (int j = col0; j < col1; j++) {
+			float alpha = tan_half * ((j / (width / 2.0f)) - 1) * aspect;
+			packet.set_ray(packet.count++, Ray(pos, glm::normalize((alpha * u + beta * v - w))));
+		}
+	}
+	packet.prepare();
 }
\ No newline at end of file
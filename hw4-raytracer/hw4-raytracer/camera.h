@@ -1,6 +1,5 @@
 #pragma once
 
-#include <GLFW/glfw3.h>	
 #include <glm/glm.hpp>	
 #include <vector>
 
@@ -9,8 +8,14 @@
 
 #define GENERATE_GETTER_SETTER(type, name, proj) \
     type get_##name() const { return name; } \
-    void set_##name(type value) { name = value; if (!proj) { update_view(); } else { update_projection(); }}
+    void set_##name(type value) { if (name == value) { return; } name = value; version++; if (!proj) { update_view(); } else { update_projection(); }}
 // proj(0) means affects the view matrix, otherwise the projection matrix
+// setting the same value again is a no-op, so it doesn't count as a change
+
+struct Resolution {
+	int w, h;
+	Resolution(int w_, int h_) : w(w_), h(h_) {}
+};
 
 enum ProjectionType {
 	PERSPECTIVE,
@@ -29,6 +34,7 @@ private:
 	float fov; // fovy
 	float z_near;
 	float z_far;
+	unsigned long long version = 0; // bumped by every change that moves a ray, see Scene::get_version
 
 	void update_view();
 	void update_projection();
@@ -51,10 +57,12 @@ public:
 	glm::mat4 vp(); // view * projection
 	glm::mat4 view_matrix();
 
+	unsigned long long get_version() const { return version; }
 	float get_aspect_ratio();
 	void rotate_left(float degrees);
 	void rotate_up(float degrees);
 	Ray ray_for_pixel(int i, int j);
+	void rays_for_block(int row0, int col0, int row1, int col1, RayPacket& packet); // row-major, 'count' set
 
 	GENERATE_GETTER_SETTER(glm::vec3, pos, 0);
 	GENERATE_GETTER_SETTER(glm::vec3, up, 0);
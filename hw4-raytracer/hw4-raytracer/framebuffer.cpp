@@ -0,0 +1,256 @@
+#include <FreeImage.h>
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <new>
+#include <vector>
+
+#include "framebuffer.h"
+
+static size_t lcm(size_t a, size_t b) {
+	size_t x = a, y = b;
+	while (y != 0) {
+		size_t t = x % y;
+		x = y;
+		y = t;
+	}
+	return a / x * b;
+}
+
+Framebuffer::Framebuffer(int width, int height, PixelFormat format) : format(format) {
+	resize(width, height);
+}
+
+Framebuffer::Framebuffer(unsigned char* pixels, int width, int height, PixelFormat format)
+	: data(pixels), owns_data(false), width(std::max(0, width)), height(std::max(0, height)), format(format) {
+	set_pitch();
+	capacity = pitch * this->height;
+}
+
+Framebuffer::~Framebuffer() {
+	if (data != nullptr && owns_data) {
+		operator delete[](data, std::align_val_t(FRAMEBUFFER_ALIGNMENT));
+	}
+}
+
+int Framebuffer::bytes_per_pixel() const {
+	switch (format) {
+	case RGBA32F: return 16;
+	case RGBA16F: return 8;
+	default:      return 3;
+	}
+}
+
+int Framebuffer::min_tile_width() const {
+	return static_cast<int>(lcm(FRAMEBUFFER_ALIGNMENT, bytes_per_pixel()) / bytes_per_pixel());
+}
+
+void Framebuffer::set_pitch() {
+	// pitch is a whole number of cache lines and of pixels, so GL can take it as a row length
+	size_t step = lcm(FRAMEBUFFER_ALIGNMENT, bytes_per_pixel());
+	pitch = (static_cast<size_t>(width) * bytes_per_pixel() + step - 1) / step * step;
+}
+
+void Framebuffer::reallocate() {
+	set_pitch();
+	size_t needed = pitch * height;
+	if (needed > capacity) {
+		if (data != nullptr && owns_data) {
+			operator delete[](data, std::align_val_t(FRAMEBUFFER_ALIGNMENT));
+		}
+		data = static_cast<unsigned char*>(operator new[](needed, std::align_val_t(FRAMEBUFFER_ALIGNMENT)));
+		capacity = needed;
+		owns_data = true;
+	}
+	clear();
+}
+
+void Framebuffer::resize(int w, int h) {
+	if (w == width && h == height && (data != nullptr || w * h == 0)) {
+		return; // same frame size, keep the storage (and the last frame)
+	}
+	width = std::max(0, w);
+	height = std::max(0, h);
+	reallocate();
+}
+
+void Framebuffer::set_format(PixelFormat f) {
+	if (f == format) {
+		return;
+	}
+	format = f;
+	reallocate();
+}
+
+void Framebuffer::clear() {
+	content_version = 0;
+	content_step = 0;
+	if (data != nullptr) {
+		std::memset(data, 0, pitch * height);
+	}
+}
+
+void Framebuffer::write(int i, int j, const glm::vec3& color) {
+	unsigned char* px = row(i);
+	switch (format) {
+	case RGBA32F: {
+		float* f = reinterpret_cast<float*>(px) + 4 * j;
+		f[0] = color.r;
+		f[1] = color.g;
+		f[2] = color.b;
+		f[3] = 1.0f;
+		break;
+	}
+	case RGBA16F: {
+		uint16_t* h = reinterpret_cast<uint16_t*>(px) + 4 * j;
+		h[0] = float_to_half(color.r);
+		h[1] = float_to_half(color.g);
+		h[2] = float_to_half(color.b);
+		h[3] = 0x3C00; // 1.0
+		break;
+	}
+	default: {
+		unsigned char* b = px + 3 * j;
+		for (int c = 0; c < 3; c++) {
+			b[c] = static_cast<unsigned char>(std::min(std::max(color[c], 0.0f), 1.0f) * 255.0f + 0.5f);
+		}
+		break;
+	}
+	}
+}
+
+glm::vec3 Framebuffer::read(int i, int j) const {
+	const unsigned char* px = row(i);
+	switch (format) {
+	case RGBA32F: {
+		const float* f = reinterpret_cast<const float*>(px) + 4 * j;
+		return glm::vec3(f[0], f[1], f[2]);
+	}
+	case RGBA16F: {
+		const uint16_t* h = reinterpret_cast<const uint16_t*>(px) + 4 * j;
+		return glm::vec3(half_to_float(h[0]), half_to_float(h[1]), half_to_float(h[2]));
+	}
+	default: {
+		const unsigned char* b = px + 3 * j;
+		return glm::vec3(b[0], b[1], b[2]) / 255.0f;
+	}
+	}
+}
+
+bool Framebuffer::save(const std::string& filename) const {
+	if (width == 0 || height == 0) {
+		std::cout << "Nothing to save: the frame is empty.\n";
+		return false;
+	}
+	std::string ext = filename.substr(filename.find_last_of('.') + 1);
+	std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+
+	FIBITMAP* img = nullptr;
+	FREE_IMAGE_FORMAT fif = FIF_PNG;
+	if (ext == "exr" || ext == "pfm") {
+		fif = (ext == "exr") ? FIF_EXR : FIF_PFM;
+		img = FreeImage_AllocateT(FIT_RGBF, width, height);
+		for (int i = 0; i < height && img != nullptr; i++) {
+			FIRGBF* line = reinterpret_cast<FIRGBF*>(FreeImage_GetScanLine(img, height - 1 - i)); // bottom-up
+			for (int j = 0; j < width; j++) {
+				glm::vec3 c = read(i, j);
+				line[j].red = c.r;
+				line[j].green = c.g;
+				line[j].blue = c.b;
+			}
+		}
+	}
+	else {
+		std::vector<BYTE> pixels(static_cast<size_t>(width) * height * 3);
+		for (int i = 0; i < height; i++) {
+			for (int j = 0; j < width; j++) {
+				glm::vec3 c = glm::clamp(read(i, j), 0.0f, 1.0f);
+				BYTE* px = &pixels[(static_cast<size_t>(i) * width + j) * 3];
+				px[0] = static_cast<BYTE>(c.b * 255.0f + 0.5f); // FreeImage wants BGR
+				px[1] = static_cast<BYTE>(c.g * 255.0f + 0.5f);
+				px[2] = static_cast<BYTE>(c.r * 255.0f + 0.5f);
+			}
+		}
+		img = FreeImage_ConvertFromRawBits(pixels.data(), width, height, width * 3, 24,
+			0xFF0000, 0x00FF00, 0x0000FF, true); // rows are top-down
+	}
+	if (img == nullptr) {
+		std::cout << "Could not save " << filename << ".\n";
+		return false;
+	}
+	bool ok = FreeImage_Save(fif, img, filename.c_str(), 0);
+	FreeImage_Unload(img);
+	std::cout << "Saving image: " << filename << "\n";
+	return ok;
+}
+
+void TileView::write(int i, int j, const glm::vec3& color) {
+	fb->write(i, j, color);
+}
+
+unsigned char* TileView::row(int i) {
+	return fb->row(i) + static_cast<size_t>(tile.col0) * fb->bytes_per_pixel();
+}
+
+uint16_t float_to_half(float f) {
+	uint32_t x;
+	std::memcpy(&x, &f, 4);
+	uint32_t sign = (x >> 16) & 0x8000;
+	uint32_t abs = x & 0x7FFFFFFF;
+
+	if (abs >= 0x7F800000) { // inf or nan
+		return static_cast<uint16_t>(sign | 0x7C00 | ((abs > 0x7F800000) ? 0x200 : 0));
+	}
+	if (abs >= 0x477FF000) { // rounds past the largest half
+		return static_cast<uint16_t>(sign | 0x7C00);
+	}
+	if (abs < 0x38800000) { // half subnormal (or zero)
+		if (abs < 0x33000000) {
+			return static_cast<uint16_t>(sign);
+		}
+		uint32_t mant = (abs & 0x007FFFFF) | 0x00800000;
+		int shift = 126 - static_cast<int>(abs >> 23);
+		uint32_t h = mant >> shift;
+		uint32_t rest = mant & ((1u << shift) - 1);
+		uint32_t half_way = 1u << (shift - 1);
+		if (rest > half_way || (rest == half_way && (h & 1))) {
+			h++;
+		}
+		return static_cast<uint16_t>(sign | h);
+	}
+	uint32_t h = ((abs - 0x38000000) >> 13);
+	uint32_t rest = abs & 0x1FFF;
+	if (rest > 0x1000 || (rest == 0x1000 && (h & 1))) {
+		h++;
+	}
+	return static_cast<uint16_t>(sign | h);
+}
+
+float half_to_float(uint16_t h) {
+	uint32_t sign = static_cast<uint32_t>(h & 0x8000) << 16;
+	uint32_t exp = (h >> 10) & 0x1F;
+	uint32_t mant = h & 0x3FF;
+	uint32_t x;
+	if (exp == 0) {
+		if (mant == 0) {
+			x = sign;
+		}
+		else { // subnormal: normalize
+			exp = 127 - 15 + 1;
+			while (!(mant & 0x400)) {
+				mant <<= 1;
+				exp--;
+			}
+			x = sign | (exp << 23) | ((mant & 0x3FF) << 13);
+		}
+	}
+	else if (exp == 31) {
+		x = sign | 0x7F800000 | (mant << 13);
+	}
+	else {
+		x = sign | ((exp + 127 - 15) << 23) | (mant << 13);
+	}
+	float f;
+	std::memcpy(&f, &x, 4);
+	return f;
+}
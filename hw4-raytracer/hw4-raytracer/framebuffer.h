@@ -0,0 +1,82 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include "render_engine.h"
+
+enum PixelFormat {
+	RGBA32F, // 16 bytes per pixel, exact
+	RGBA16F, // 8 bytes per pixel, half floats
+	RGB8     // 3 bytes per pixel, clamped to [0, 1]
+};
+
+const int FRAMEBUFFER_ALIGNMENT = 64; // cache line: rows start on one, so do tiles of min_tile_width() multiples
+
+class Framebuffer;
+
+// Writable window onto one tile of a framebuffer, handed to the worker that shades it.
+struct TileView {
+	Framebuffer* fb;
+	Tile tile;
+
+	void write(int i, int j, const glm::vec3& color); // absolute pixel coordinates inside 'tile'
+	unsigned char* row(int i);                         // first byte of row i inside 'tile'
+};
+
+// Frame storage: one aligned allocation, rows padded to whole cache lines.
+// Colors are linear in [0, 1]; float formats keep values above 1, RGB8 clamps them.
+// Kept across frames: resize() only reallocates when the frame gets bigger.
+// Can also be a view over memory owned elsewhere (e.g. a mapped pixel buffer) with the same layout.
+class Framebuffer {
+private:
+	unsigned char* data = nullptr;
+	size_t capacity = 0; // bytes allocated
+	bool owns_data = true; // false for a view, until resizing it past its memory allocates storage of its own
+	int width = 0;
+	int height = 0;
+	PixelFormat format;
+	size_t pitch = 0; // bytes per row: a multiple of the cache line and of the pixel size
+	unsigned long long content_version = 0; // scene state the pixels show (0: none), see Scene::raytrace
+	int content_step = 0; // 1: every pixel traced, N: one pixel per NxN block (progressive preview)
+
+	void set_pitch();
+	void reallocate();
+
+public:
+	Framebuffer(int width = 0, int height = 0, PixelFormat format = RGBA32F);
+	Framebuffer(unsigned char* pixels, int width, int height, PixelFormat format); // view, pixels are not cleared
+	~Framebuffer();
+	Framebuffer(const Framebuffer&) = delete;
+	Framebuffer& operator=(const Framebuffer&) = delete;
+
+	void resize(int w, int h);
+	void set_format(PixelFormat f);
+	void clear(); // all pixels black
+
+	int get_width() const { return width; }
+	int get_height() const { return height; }
+	PixelFormat get_format() const { return format; }
+	size_t get_pitch() const { return pitch; }
+	int bytes_per_pixel() const;
+	int min_tile_width() const; // tiles this wide (or a multiple) never share a cache line
+	unsigned char* get_data() { return data; }
+	const unsigned char* get_data() const { return data; }
+	unsigned char* row(int i) { return data + pitch * i; }
+	const unsigned char* row(int i) const { return data + pitch * i; }
+	TileView tile(const Tile& t) { return TileView{ this, t }; }
+	unsigned long long get_content_version() const { return content_version; }
+	int get_content_step() const { return content_step; }
+	void set_content_version(unsigned long long v, int step = 1) { content_version = v; content_step = step; }
+
+	void write(int i, int j, const glm::vec3& color); // row i, column j
+	glm::vec3 read(int i, int j) const;
+
+	// .png (8-bit), .exr or .pfm (float), picked by extension
+	bool save(const std::string& filename) const;
+};
+
+// IEEE half precision conversions (round to nearest even)
+uint16_t float_to_half(float f);
+float half_to_float(uint16_t h);
@@ -0,0 +1,419 @@
+#include <FreeImage.h>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <climits>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "scene.h"
+#include "framebuffer.h"
+#include "readfile.h"
+
+/*
+    Offline renderer: reads a scene file, builds the BVH, traces the main camera (or a batch
+    of cameras) with the parallel engine and writes the images. No window or OpenGL context
+    is created, so it runs on machines without a display (render farm entry point).
+
+    usage: hw4-headless <scene file> [options]
+        -o <file>     output image, .png / .exr / .pfm (default: the scene's "output", else raytrace.png)
+        -w <pixels>   image width  (default: the scene's "size")
+        -h <pixels>   image height
+        -t <threads>  render threads, 0 for all hardware threads (default: the scene's "threads", else 0)
+        --tile <n>    tile size in pixels
+        -c <cameras>  "all" or a list like 0,2,3: renders those cameras in one batch, sharing the scene
+                      and BVH, into <output>_cam<N>.<ext> (default: the main camera only, into <output>)
+        --layout-bench  no image: traces the main camera's primary rays once per BVH node layout and
+                      prints time and cache/TLB miss counts for each (Linux perf counters)
+        --edit-bench  no image: takes a quarter of the objects out of the built BVH and puts them back
+                      in place, checks the main camera's frame against one traced before the edits
+                      and prints the edit time next to a full rebuild
+
+    A scene with "frames N" renders a sequence of the main camera into <output>_0000.<ext>, ...
+*/
+
+const std::string DEFAULT_OUTPUT = "raytrace.png";
+
+void printUsage(const char* program) {
+    std::cout << "usage: " << program << " <scene file> [-o output.png|.exr|.pfm] [-w width] [-h height]"
+        << " [-t threads] [--tile size] [-c all|0,1,...] [--layout-bench] [--edit-bench]\n";
+}
+
+// "scene.png", 2 -> "scene_cam2.png"
+std::string viewOutputName(const std::string& output, int cam) {
+    size_t dot = output.find_last_of('.');
+    size_t slash = output.find_last_of("/\\");
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) {
+        return output + "_cam" + std::to_string(cam);
+    }
+    return output.substr(0, dot) + "_cam" + std::to_string(cam) + output.substr(dot);
+}
+
+// "scene.png", 7 -> "scene_0007.png"
+std::string frameOutputName(const std::string& output, int frame) {
+    char number[16];
+    snprintf(number, sizeof(number), "_%04d", frame);
+    size_t dot = output.find_last_of('.');
+    size_t slash = output.find_last_of("/\\");
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash)) {
+        return output + number;
+    }
+    return output.substr(0, dot) + number + output.substr(dot);
+}
+
+/*
+    Renders every frame of the scene's sequence. Parsing and mesh BVHs are paid once; per frame
+    the keys are applied through the camera/object setters, and the scene BVH is only refit
+    when an object moved (see Scene::update_bvh). Frames alternate between two framebuffers so that writing frame N
+    (image encoding and disk) runs on its own thread while frame N+1 is set up and traced.
+    A frame that changes nothing is not traced again.
+*/
+bool renderSequence(Scene* scene, const std::string& output) {
+    Sequence& sequence = scene->get_sequence();
+    Framebuffer frames[2] = { Framebuffer(0, 0, RGBA32F), Framebuffer(0, 0, RGBA32F) };
+    std::thread writer;
+    bool saved = true;
+    double setup_ms = 0.0, trace_ms = 0.0;
+
+    for (int f = 0; f < sequence.get_frames(); f++) {
+        auto t0 = std::chrono::steady_clock::now();
+        sequence.apply(scene, f);
+        scene->update_bvh();
+        auto t1 = std::chrono::steady_clock::now();
+        Framebuffer& frame = frames[f % 2]; // its last writer (frame f - 2) was joined before frame f - 1 started
+        const Framebuffer& last = frames[(f + 1) % 2]; // frame f - 1, possibly still being written (read only)
+        unsigned long long current = scene->get_version();
+        if (last.get_content_version() == current && frame.get_content_version() != current
+            && frame.get_width() == last.get_width() && frame.get_height() == last.get_height()) {
+            std::memcpy(frame.get_data(), last.get_data(), frame.get_pitch() * frame.get_height()); // nothing moved
+            frame.set_content_version(current);
+        }
+        scene->raytrace(frame);
+        auto t2 = std::chrono::steady_clock::now();
+        setup_ms += std::chrono::duration<double, std::milli>(t1 - t0).count();
+        trace_ms += std::chrono::duration<double, std::milli>(t2 - t1).count();
+
+        if (writer.joinable()) {
+            writer.join();
+        }
+        std::string name = frameOutputName(output, f);
+        writer = std::thread([&frame, name, &saved]() {
+            saved = frame.save(name) && saved;
+        });
+    }
+    if (writer.joinable()) {
+        writer.join();
+    }
+    std::cout << "Rendered " << sequence.get_frames() << " frames: setup " << setup_ms << " ms, trace " << trace_ms << " ms\n";
+    return saved;
+}
+
+// hardware counter for the calling thread only (-1 if the kernel or the machine doesn't offer it)
+int openCounter(unsigned type, unsigned long long config) {
+#ifdef __linux__
+    perf_event_attr attr;
+    std::memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return static_cast<int>(syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0));
+#else
+    return -1;
+#endif
+}
+
+long long readCounter(int fd) {
+    long long value = -1;
+#ifdef __linux__
+    if (fd < 0 || read(fd, &value, sizeof(value)) != sizeof(value)) {
+        return -1;
+    }
+#endif
+    return value;
+}
+
+/*
+    Node layout benchmark: the same BVHs are put into each BVHNodeLayout in turn, and the main
+    camera's primary rays are traced through Scene::closest_intersection on this thread, so the
+    per-thread counters see exactly the traversal. One warm-up pass per layout, then a counted one.
+*/
+void benchmarkLayouts(Scene* scene) {
+    const BVHNodeLayout layouts[] = { BVH_LAYOUT_DEPTH_FIRST, BVH_LAYOUT_VEB, BVH_LAYOUT_TREELET };
+    const char* names[] = { "depth-first", "vEB", "treelet" };
+    std::vector<int> counters;
+#ifdef __linux__
+    counters.push_back(openCounter(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D
+        | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)));
+    counters.push_back(openCounter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES)); // last level
+    counters.push_back(openCounter(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB
+        | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)));
+#endif
+    const char* counter_names[] = { "L1D misses", "LLC misses", "dTLB misses" };
+    if (counters.empty() || counters[0] < 0) {
+        std::cout << "(no hardware counters here, timing only)\n";
+    }
+
+    Camera* cam = scene->get_main_camera();
+    for (int l = 0; l < 3; l++) {
+        scene->set_bvh_layout(layouts[l]);
+        for (int pass = 0; pass < 2; pass++) {
+#ifdef __linux__
+            for (int fd : counters) {
+                if (fd >= 0) {
+                    ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+                    ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+                }
+            }
+#endif
+            auto t0 = std::chrono::steady_clock::now();
+            int hits = 0;
+            for (int i = 0; i < cam->get_height(); i++) {
+                for (int j = 0; j < cam->get_width(); j++) {
+                    Ray ray = cam->ray_for_pixel(i, j);
+                    hits += (scene->closest_intersection(ray).hit_obj != nullptr);
+                }
+            }
+            auto t1 = std::chrono::steady_clock::now();
+#ifdef __linux__
+            for (int fd : counters) {
+                if (fd >= 0) {
+                    ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+                }
+            }
+#endif
+            if (pass == 0) {
+                continue; // warm-up
+            }
+            std::cout << names[l] << ": " << std::chrono::duration<double, std::milli>(t1 - t0).count() << " ms, "
+                << hits << " hits";
+            for (size_t c = 0; c < counters.size(); c++) {
+                long long value = readCounter(counters[c]);
+                if (value >= 0) {
+                    std::cout << ", " << value << " " << counter_names[c];
+                }
+            }
+            std::cout << "\n";
+        }
+    }
+#ifdef __linux__
+    for (int fd : counters) {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+#endif
+}
+
+/*
+    In-place edit check: the last quarter of the objects is taken out of the built scene BVH one by
+    one (Scene::remove_object), then added back (Scene::add_object), so the tree is edited rather than
+    rebuilt. The main camera's frame has to come out the same as before the edits.
+*/
+bool benchmarkEdits(Scene* scene) {
+    Framebuffer before(0, 0, RGBA32F), after(0, 0, RGBA32F);
+    scene->construct_bvh();
+    scene->raytrace(before);
+
+    int count = std::max(1, scene->how_many_objects() / 4);
+    std::vector<Object*> taken;
+    auto t0 = std::chrono::steady_clock::now();
+    for (int k = 0; k < count && scene->last_object() != nullptr; k++) {
+        taken.push_back(scene->last_object());
+        scene->remove_object(taken.back());
+    }
+    auto t1 = std::chrono::steady_clock::now();
+    for (auto it = taken.rbegin(); it != taken.rend(); ++it) {
+        scene->add_object(*it); // back in the original order
+    }
+    scene->update_bvh();
+    auto t2 = std::chrono::steady_clock::now();
+    scene->raytrace(after);
+    auto t3 = std::chrono::steady_clock::now();
+    scene->construct_bvh();
+    auto t4 = std::chrono::steady_clock::now();
+
+    int differing = 0;
+    for (int i = 0; i < before.get_height(); i++) {
+        for (int j = 0; j < before.get_width(); j++) {
+            differing += (before.read(i, j) != after.read(i, j));
+        }
+    }
+    std::cout << "Removed " << taken.size() << " objects in " << std::chrono::duration<double, std::milli>(t1 - t0).count()
+        << " ms, added them back in " << std::chrono::duration<double, std::milli>(t2 - t1).count() << " ms (rebuild: "
+        << std::chrono::duration<double, std::milli>(t4 - t3).count() << " ms), " << differing << " pixels differ\n";
+    return differing == 0;
+}
+
+// whole decimal number no smaller than 'min'; false for anything else (atoi would take "abc" as 0)
+bool parseInt(const char* text, int min, int& value) {
+    char* end = nullptr;
+    errno = 0;
+    long v = strtol(text, &end, 10);
+    if (end == text || *end != '\0' || errno == ERANGE || v < min || v > INT_MAX) {
+        return false;
+    }
+    value = static_cast<int>(v);
+    return true;
+}
+
+// "all" or comma separated camera ids; false if any id is not a camera of the scene
+bool parseCameras(const std::string& arg, int camera_count, std::vector<int>& ids) {
+    if (arg == "all") {
+        for (int i = 0; i < camera_count; i++) {
+            ids.push_back(i);
+        }
+        return camera_count > 0;
+    }
+    std::stringstream s(arg);
+    std::string item;
+    while (std::getline(s, item, ',')) {
+        int id = 0;
+        if (!parseInt(item.c_str(), 0, id) || id >= camera_count) {
+            std::cerr << "No camera " << item << " in the scene (it has " << camera_count << ").\n";
+            return false;
+        }
+        ids.push_back(id);
+    }
+    return !ids.empty();
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2 || argv[1][0] == '-') {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    // command line options override the scene file
+    std::string output;
+    int width = 0, height = 0;
+    int threads = -1;
+    int tile = 0;
+    std::string camera_list; // empty: main camera only
+    bool layout_bench = false;
+    bool edit_bench = false;
+    for (int i = 2; i < argc; i++) {
+        bool has_value = (i + 1 < argc);
+        bool valid = true;
+        if (!strcmp(argv[i], "-o") && has_value) output = argv[++i];
+        else if (!strcmp(argv[i], "-w") && has_value) valid = parseInt(argv[++i], 1, width);
+        else if (!strcmp(argv[i], "-h") && has_value) valid = parseInt(argv[++i], 1, height);
+        else if (!strcmp(argv[i], "-t") && has_value) valid = parseInt(argv[++i], 0, threads);
+        else if (!strcmp(argv[i], "--tile") && has_value) valid = parseInt(argv[++i], 1, tile);
+        else if (!strcmp(argv[i], "-c") && has_value) camera_list = argv[++i];
+        else if (!strcmp(argv[i], "--layout-bench")) layout_bench = true;
+        else if (!strcmp(argv[i], "--edit-bench")) edit_bench = true;
+        else {
+            std::cerr << "Unknown option: " << argv[i] << "\n";
+            printUsage(argv[0]);
+            return 1;
+        }
+        if (!valid) {
+            std::cerr << "Invalid value for " << argv[i - 1] << ": " << argv[i] << "\n";
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+
+    Resolution res(640, 480);
+    Scene* scene = nullptr;
+    try {
+        scene = readfile(argv[1], res);
+    }
+    catch (...) {
+        return 1; // readfile already reported it
+    }
+    Camera* cam = scene->get_main_camera();
+    if (cam == nullptr) {
+        std::cerr << "Scene " << argv[1] << " has no camera, nothing to render.\n";
+        delete scene;
+        return 1;
+    }
+    std::vector<int> cam_ids;
+    if (!camera_list.empty() && !parseCameras(camera_list, scene->how_many_cameras(), cam_ids)) {
+        delete scene;
+        return 1;
+    }
+    for (int i = 0; i < scene->how_many_cameras(); i++) {
+        if (width > 0) scene->get_camera(i)->set_width(width);
+        if (height > 0) scene->get_camera(i)->set_height(height);
+    }
+    if (threads >= 0) scene->set_render_threads(threads);
+    if (tile > 0) scene->set_render_tile_size(tile);
+    if (output.empty()) {
+        output = scene->get_output_file().empty() ? DEFAULT_OUTPUT : scene->get_output_file();
+    }
+
+    if (layout_bench) {
+        scene->construct_bvh();
+        benchmarkLayouts(scene);
+        delete scene;
+        return 0;
+    }
+    if (edit_bench) {
+        bool same = benchmarkEdits(scene);
+        delete scene;
+        return same ? 0 : 1;
+    }
+
+    if (scene->get_sequence().get_frames() > 0) {
+        if (!cam_ids.empty()) {
+            std::cerr << "-c is not supported for sequences, they render the main camera.\n";
+            delete scene;
+            return 1;
+        }
+        FreeImage_Initialise();
+        bool saved = renderSequence(scene, output);
+        FreeImage_DeInitialise();
+        delete scene;
+        return saved ? 0 : 1;
+    }
+
+    auto t0 = std::chrono::steady_clock::now();
+    scene->construct_bvh();
+    auto t1 = std::chrono::steady_clock::now();
+
+    // full precision, so .exr/.pfm keep everything that was traced
+    std::vector<Framebuffer*> frames;
+    if (cam_ids.empty()) {
+        frames.push_back(new Framebuffer(0, 0, RGBA32F));
+        scene->raytrace(*frames[0]);
+    }
+    else {
+        for (size_t v = 0; v < cam_ids.size(); v++) {
+            frames.push_back(new Framebuffer(0, 0, RGBA32F));
+        }
+        scene->raytrace_views(cam_ids, frames);
+    }
+    auto t2 = std::chrono::steady_clock::now();
+
+    std::cout << "Rendered " << frames.size() << " view(s), " << frames[0]->get_width() << "x" << frames[0]->get_height()
+        << " on " << scene->get_render_threads() << " threads: BVH "
+        << std::chrono::duration<double, std::milli>(t1 - t0).count() << " ms, trace "
+        << std::chrono::duration<double, std::milli>(t2 - t1).count() << " ms\n";
+
+    FreeImage_Initialise();
+    bool saved = true;
+    for (size_t v = 0; v < frames.size(); v++) {
+        std::string name = cam_ids.empty() ? output : viewOutputName(output, cam_ids[v]);
+        saved = frames[v]->save(name) && saved;
+        delete frames[v];
+    }
+    FreeImage_DeInitialise();
+
+    delete scene;
+    return saved ? 0 : 1;
+}
@@ -1,6 +1,4 @@
 #pragma once
-#include <glad/glad.h>
-#include <GLFW/glfw3.h>
 #include <glm/glm.hpp>
 
 enum LightType {
@@ -13,10 +11,15 @@ public:
 	LightType type;
 	glm::vec3 posdir; // position if POINT, direction if DIRECTIONAL
 	glm::vec3 rgb;
-	
+	unsigned long long version = 0; // bumped by the setters; change lights through them so the scene notices
+
+
 	Light(LightType t, glm::vec3 pos, glm::vec3 color) {
 		type = t;
 		posdir = pos;
 		rgb = color;
 	};
+
+	void set_posdir(glm::vec3 p) { posdir = p; version++; }
+	void set_rgb(glm::vec3 color) { rgb = color; version++; }
 };
\ No newline at end of file
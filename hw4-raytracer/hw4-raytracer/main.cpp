@@ -2,6 +2,8 @@
 #include <GLFW/glfw3.h>
 #include <glm/glm.hpp>
 #include <FreeImage.h>
+#include <algorithm>
+#include <cstring>
 #include <iostream>
 #include <string>
 #include <fstream>
@@ -11,6 +13,7 @@
 
 #include "transform.h"
 #include "scene.h"
+#include "framebuffer.h"
 #include "shader.h"
 #include "window.h"
 #include "readfile.h"
@@ -22,6 +25,7 @@ void resizeWindowCallback(GLFWwindow* window, int width, int height);
 void keyCallback(GLFWwindow* window, int key, int scancode, int action, int mods);
 void initialize(int argc, char* argv[]);
 void printHelp();
+void deleteDisplayTexture();
 void saveScreenshot(std::string fname, Window* window);
 
 Window* window1; // can be extended to multiple later
@@ -63,6 +67,31 @@ unsigned int quad_idx[] = {
      2, 3, 0
 };
 
+// The raytraced frame is shown through one texture that lives as long as its size does.
+// Frames reach it through a ring of pixel-unpack buffers: the renderer writes into a mapped
+// buffer, and the driver may still be copying the previous one while we fill the next.
+const int PBO_RING = 2;
+// frame state (version, preview step) and the preview passes' samples; full passes go straight to a PBO.
+// Half floats halve the upload of RGBA32F
+Framebuffer display_frame(0, 0, RGBA16F);
+unsigned int display_tex = 0;
+unsigned int display_pbo[PBO_RING] = { 0 };
+int display_pbo_next = 0;
+int display_width = 0, display_height = 0;
+PixelFormat display_format = RGBA16F;
+
+// what uploadFrame() did
+enum FrameUpload {
+    FRAME_CURRENT,  // nothing to trace: the texture shows the current frame
+    FRAME_UPLOADED, // a pass was traced and uploaded (more follow while the preview refines)
+    FRAME_FAILED    // the pixel buffer could not be mapped or lost its contents; the frame is still due
+};
+const int UPLOAD_RETRIES = 3; // failed uploads retried right away before waiting for input
+
+// progressive preview: after a change the first frame traces one pixel per 8x8 block, then refines
+const int PREVIEW_STEP = 8;
+int preview_step = PREVIEW_STEP; // 1: always trace the full frame
+
 
 /* 
     Adjusts viewport dimensions to (width, height) when window is resized.
@@ -137,6 +166,16 @@ void keyCallback(GLFWwindow* window, int key, int scanline, int action, int mods
                 sx = 1.0, sy = 1.0;
                 tx = 0.0, ty = 0.0;
                 break;
+            case GLFW_KEY_P:
+                saveScreenshot("screenshot.png", window1);
+                break;
+            case GLFW_KEY_B:
+                window1->scene->print_traversal_stats();
+                break;
+            case GLFW_KEY_F:
+                preview_step = (preview_step > 1) ? 1 : PREVIEW_STEP;
+                std::cout << "Progressive preview " << ((preview_step > 1) ? "on" : "off") << "\n";
+                break;
             case GLFW_KEY_V:
                 // use WINDOW here because it directly processes the callback function
                 window1->scene->set_transform_type(ROTATE);
@@ -231,44 +270,147 @@ void initQuad(unsigned int &VAO, unsigned int& VBO, unsigned int& EBO) {
     // Set up vertex attribute pointers
     glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(float), (void*)0); // other 2 coordinates for texture
     glEnableVertexAttribArray(0);
+    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(float), (void*)(2 * sizeof(float)));
+    glEnableVertexAttribArray(1);
 
     // Unbind VAO
     glBindVertexArray(0);
 }
 
-// add Image &cam_data when done with testing to parameters as texture
-void renderQuad(std::vector<unsigned char> texture, unsigned int &VAO) {
-    // takes in the Image created from the ray tracer in Scene
-    glBindVertexArray(VAO);
+// texture/upload formats matching a Framebuffer layout
+void glFormatOf(PixelFormat f, GLenum& internal_format, GLenum& format, GLenum& type) {
+    switch (f) {
+    case RGBA32F: internal_format = GL_RGBA32F; format = GL_RGBA; type = GL_FLOAT; break;
+    case RGBA16F: internal_format = GL_RGBA16F; format = GL_RGBA; type = GL_HALF_FLOAT; break;
+    default:      internal_format = GL_RGB8;    format = GL_RGB;  type = GL_UNSIGNED_BYTE; break;
+    }
+}
 
-    // load texture
-    unsigned int tex0;
-    glGenTextures(1, &tex0);
-    glBindTexture(GL_TEXTURE_2D, tex0);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+/*
+    (Re)creates the display texture and its PBO ring when the frame size or format changes.
+*/
+void initDisplayTexture(const Framebuffer& frame) {
+    int width = frame.get_width(), height = frame.get_height();
+    if (display_tex != 0 && width == display_width && height == display_height && frame.get_format() == display_format) {
+        return; // still the right size
+    }
+    deleteDisplayTexture();
+    display_width = width;
+    display_height = height;
+    display_format = frame.get_format();
+
+    GLenum internal_format, format, type;
+    glFormatOf(display_format, internal_format, format, type);
+    glGenTextures(1, &display_tex);
+    glBindTexture(GL_TEXTURE_2D, display_tex);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST); // one texel per pixel, no mipmaps needed
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, cam1->get_width(), cam1->get_height(), 0, GL_RGB, GL_UNSIGNED_BYTE, texture.data());
-    glGenerateMipmap(GL_TEXTURE_2D);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+    // allocated once per size (glTexStorage2D is GL 4.2, our loader is 4.1); later frames only replace texels
+    glTexImage2D(GL_TEXTURE_2D, 0, internal_format, width, height, 0, format, type, nullptr);
+
+    // same layout as the framebuffer (padded rows included), so copies and uploads share offsets
+    glGenBuffers(PBO_RING, display_pbo);
+    for (int i = 0; i < PBO_RING; i++) {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, display_pbo[i]);
+        glBufferData(GL_PIXEL_UNPACK_BUFFER, static_cast<GLsizeiptr>(frame.get_pitch()) * height, nullptr, GL_STREAM_DRAW);
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    display_pbo_next = 0;
+}
 
-    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(float), (void*)(2 * sizeof(float)));
-    glEnableVertexAttribArray(1);
-    
-    glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
-    glBindVertexArray(0); // unbind
+void deleteDisplayTexture() {
+    if (display_tex != 0) {
+        glDeleteTextures(1, &display_tex);
+        glDeleteBuffers(PBO_RING, display_pbo);
+    }
+    display_tex = 0;
+    for (int i = 0; i < PBO_RING; i++) {
+        display_pbo[i] = 0;
+    }
 }
 
-std::vector<unsigned char> flattenTexture(const RGBImage& texture) {
-    std::vector<unsigned char> flattened;
-    for (const auto& row : texture) {
-        for (const auto& pixel : row) {
-            flattened.push_back(static_cast<unsigned char>(pixel.r));
-            flattened.push_back(static_cast<unsigned char>(pixel.g));
-            flattened.push_back(static_cast<unsigned char>(pixel.b));
+/*
+    Raytraces the next frame and uploads the tiles that were shaded (one call when they cover the
+    whole frame). A pass over every pixel is traced straight into the next mapped PBO; preview passes
+    go through display_frame, which keeps their samples for the next pass, and only their tiles are
+    copied over. With the preview on, each call runs one pass, so the window updates between passes.
+*/
+FrameUpload uploadFrame(Scene* scene) {
+    scene->update_bvh(); // refit after objects moved (no-op otherwise)
+    Camera* cam = scene->get_main_camera();
+    display_frame.resize(cam->get_width(), cam->get_height()); // as raytrace() would, so the PBO fits
+    if (scene->is_current(display_frame)) {
+        return FRAME_CURRENT; // texture still holds the last frame
+    }
+    initDisplayTexture(display_frame);
+
+    int w = display_width, h = display_height;
+    size_t pitch = display_frame.get_pitch();
+    size_t bpp = display_frame.bytes_per_pixel();
+    GLsizeiptr size = static_cast<GLsizeiptr>(pitch) * h;
+
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, display_pbo[display_pbo_next]);
+    display_pbo_next = (display_pbo_next + 1) % PBO_RING;
+
+    // invalidate: old contents are never uploaded again, so the driver need not keep them
+    unsigned char* dst = static_cast<unsigned char*>(
+        glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT));
+    if (dst == nullptr) {
+        std::cerr << "could not map the pixel buffer, frame skipped\n";
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        return FRAME_FAILED;
+    }
+    Framebuffer mapped(dst, w, h, display_frame.get_format()); // same layout as display_frame
+    std::vector<Tile> shaded = scene->raytrace(display_frame, preview_step, &mapped);
+    long long covered = 0;
+    for (const Tile& t : shaded) {
+        covered += static_cast<long long>(t.row1 - t.row0) * (t.col1 - t.col0);
+    }
+    bool full = (covered == static_cast<long long>(w) * h);
+    if (display_frame.get_content_step() > 1) { // preview pass: its tiles are in display_frame
+        for (const Tile& t : shaded) {
+            for (int i = t.row0; i < t.row1; i++) {
+                size_t offset = pitch * i + bpp * t.col0;
+                std::memcpy(dst + offset, display_frame.get_data() + offset, bpp * (t.col1 - t.col0));
+            }
         }
     }
-    return flattened;
+    if (glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER) == GL_FALSE) { // contents lost (e.g. display mode change)
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        display_frame.set_content_version(0); // trace it again next time
+        return FRAME_FAILED;
+    }
+
+    GLenum internal_format, format, type;
+    glFormatOf(display_format, internal_format, format, type);
+    glBindTexture(GL_TEXTURE_2D, display_tex);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, static_cast<GLint>(pitch / bpp)); // rows are padded to cache lines
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    if (full) {
+        glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, w, h, format, type, (void*)0);
+    }
+    else { // sub-rectangles of the buffer: offsets are byte positions
+        for (const Tile& t : shaded) {
+            size_t offset = pitch * t.row0 + bpp * t.col0;
+            glTexSubImage2D(GL_TEXTURE_2D, 0, t.col0, t.row0, t.col1 - t.col0, t.row1 - t.row0,
+                format, type, (void*)offset);
+        }
+    }
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    return FRAME_UPLOADED;
+}
+
+void renderQuad(unsigned int tex, unsigned int &VAO) {
+    // draws the quad with the persistent display texture
+    glBindVertexArray(VAO);
+    glBindTexture(GL_TEXTURE_2D, tex);
+    glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+    glBindVertexArray(0); // unbind
 }
 
 
@@ -306,8 +448,9 @@ void initialize(int argc, char* argv[]) {
     else {
         std::cout << "Data read from " << argv[1] << ".\n";
         const char* filepath = argv[1];
-        window1 = readfile(filepath); // scene already attached
-        scene1 = window1->scene;
+        Resolution res(init_width, init_height);
+        scene1 = readfile(filepath, res);
+        window1 = new Window(res.w, res.h, "raytracer", scene1);
         cam1 = scene1->get_main_camera();
         std::cout << scene1->how_many_objects() << "<- objects registered\n";
     }
@@ -430,26 +573,15 @@ void display()
 
 
 void saveScreenshot(std::string fname, Window* window) {
-    Camera* main_cam = window->scene->get_main_camera();
-    if (main_cam == NULL) {
+    // the current view traced again at full precision: full frames only live in the PBOs (no read-back from GL)
+    if (window->scene->get_main_camera() == NULL) {
         std::cout << "Could not save screenshot: Scene has no camera.";
         return;
     }
-    int pix = main_cam->get_width() * main_cam->get_height();
-    BYTE* pixels = new BYTE[3 * pix];
-    glReadBuffer(GL_FRONT);
-    glReadPixels(0, 0, main_cam->get_width(), main_cam->get_height(), GL_BGR, GL_UNSIGNED_BYTE, pixels);
-
-    FIBITMAP* img = FreeImage_ConvertFromRawBits(
-        pixels, 
-        main_cam->get_width(),
-        main_cam->get_height(),
-        main_cam->get_width() * 3, 24, 0xFF0000, 0x00FF00, 0x0000FF, false);
-
-    std::cout << "Saving screenshot: " << fname << "\n";
-
-    FreeImage_Save(FIF_PNG, img, fname.c_str(), 0);
-    delete[] pixels;
+    Framebuffer shot(0, 0, RGBA32F);
+    window->scene->update_bvh();
+    window->scene->raytrace(shot);
+    shot.save(fname);
 }
 
 
@@ -458,6 +590,9 @@ void printHelp() {
         << "press '+' or '-' to change the amount of rotation that\noccurs with each arrow press.\n"
         << "press 'r' to reset the transformations.\n"
         << "press 'v' 't' 's' to rotate (view) [default], translate, scale.\n"
+        << "press 'b' to print BVH traversal counters since the last 'b'.\n"
+        << "press 'p' to save the current frame to screenshot.png.\n"
+        << "press 'f' to toggle the progressive (low resolution first) preview.\n"
         << "press ESC to quit.\n";
 }
 
@@ -519,20 +654,32 @@ int main(int argc, char* argv[])
     printHelp();
 
     // render loop
+    int upload_failures = 0; // uploadFrame() failures in a row
     while (window1->is_active()) { // if not instructed to close
         glClearColor(0.0f, 0.0f, 0.0f, 1.0f);
         glClear(GL_COLOR_BUFFER_BIT);
         shader.use();
 
-        // render the quad with the texture from the scene's camera
-        renderQuad(flattenTexture(scene1->raytrace()), VAO);
-
-        window1->poll_events();
+        // render the quad with the texture from the scene's camera (resized along with the camera)
+        FrameUpload status = uploadFrame(scene1);
+        renderQuad(display_tex, VAO);
         window1->swap_buffers();
+        upload_failures = (status == FRAME_FAILED) ? upload_failures + 1 : 0;
+
+        // nothing changed: present the cached texture and sleep until input instead of re-tracing.
+        // while refining, only poll, so a key press cancels the remaining passes and restarts coarse.
+        // a failed upload is retried on the next few frames, then only after input
+        if (status == FRAME_UPLOADED || (status == FRAME_FAILED && upload_failures <= UPLOAD_RETRIES)) {
+            window1->poll_events();
+        }
+        else {
+            window1->wait_events();
+        }
     }
 
     // deallocation of resources
     shader.remove(); // calls glDeleteProgram
+    deleteDisplayTexture();
     glDeleteVertexArrays(1, &VAO);
     glDeleteBuffers(1, &VBO);
     glDeleteBuffers(1, &EBO);
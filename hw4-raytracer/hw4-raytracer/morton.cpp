@@ -0,0 +1,85 @@
+#include <algorithm>
+
+#include "morton.h"
+#include "thread_pool.h"
+
+const int RADIX_BITS = 8;
+const int RADIX_BUCKETS = 1 << RADIX_BITS;
+const int RADIX_CHUNK = 1 << 16; // keys per task; smaller arrays are sorted on the calling thread
+
+// spreads the low 21 bits of v so that two zero bits follow each of them
+static uint64_t spread_bits(uint64_t v) {
+	v &= 0x1FFFFF;
+	v = (v | (v << 32)) & 0x001F00000000FFFFull;
+	v = (v | (v << 16)) & 0x001F0000FF0000FFull;
+	v = (v | (v << 8)) & 0x100F00F00F00F00Full;
+	v = (v | (v << 4)) & 0x10C30C30C30C30C3ull;
+	v = (v | (v << 2)) & 0x1249249249249249ull;
+	return v;
+}
+
+uint64_t morton_code(const glm::vec3& unit) {
+	const float scale = static_cast<float>((1 << 21) - 1);
+	uint64_t x = static_cast<uint64_t>(std::min(std::max(unit.x * scale, 0.0f), scale));
+	uint64_t y = static_cast<uint64_t>(std::min(std::max(unit.y * scale, 0.0f), scale));
+	uint64_t z = static_cast<uint64_t>(std::min(std::max(unit.z * scale, 0.0f), scale));
+	return spread_bits(x) | (spread_bits(y) << 1) | (spread_bits(z) << 2);
+}
+
+void radix_sort(std::vector<uint64_t>& keys, std::vector<int>& values, int key_bits) {
+	int n = static_cast<int>(keys.size());
+	if (n < 2) {
+		return;
+	}
+	int chunks = (n + RADIX_CHUNK - 1) / RADIX_CHUNK;
+	std::vector<uint64_t> keys_tmp(n);
+	std::vector<int> values_tmp(n);
+	std::vector<int> hist(static_cast<size_t>(chunks) * RADIX_BUCKETS); // per chunk, then scatter offsets
+	auto run = [chunks](const std::function<void(int)>& body) {
+		if (chunks == 1) {
+			body(0);
+		}
+		else {
+			ThreadPool::shared().parallel_for(chunks, body);
+		}
+	};
+
+	for (int shift = 0; shift < key_bits; shift += RADIX_BITS) {
+		std::fill(hist.begin(), hist.end(), 0);
+		run([&](int c) {
+			int* h = &hist[static_cast<size_t>(c) * RADIX_BUCKETS];
+			for (int i = c * RADIX_CHUNK; i < std::min(n, (c + 1) * RADIX_CHUNK); i++) {
+				h[(keys[i] >> shift) & (RADIX_BUCKETS - 1)]++;
+			}
+		});
+
+		// exclusive prefix over (digit, chunk), so each chunk scatters into its own slots and the sort stays stable
+		int sum = 0;
+		bool one_digit = false;
+		for (int d = 0; d < RADIX_BUCKETS; d++) {
+			int digit_total = 0;
+			for (int c = 0; c < chunks; c++) {
+				int& h = hist[static_cast<size_t>(c) * RADIX_BUCKETS + d];
+				int count = h;
+				h = sum;
+				sum += count;
+				digit_total += count;
+			}
+			one_digit = one_digit || (digit_total == n);
+		}
+		if (one_digit) {
+			continue; // already in order for this digit
+		}
+
+		run([&](int c) {
+			int* offset = &hist[static_cast<size_t>(c) * RADIX_BUCKETS];
+			for (int i = c * RADIX_CHUNK; i < std::min(n, (c + 1) * RADIX_CHUNK); i++) {
+				int dst = offset[(keys[i] >> shift) & (RADIX_BUCKETS - 1)]++;
+				keys_tmp[dst] = keys[i];
+				values_tmp[dst] = values[i];
+			}
+		});
+		keys.swap(keys_tmp);
+		values.swap(values_tmp);
+	}
+}
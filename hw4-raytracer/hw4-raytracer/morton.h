@@ -0,0 +1,14 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <cstdint>
+#include <vector>
+
+// 63-bit Morton code of a point in the unit cube: 21 bits per axis, interleaved (x in the lowest
+// bit). Sorting by it puts primitives that are close in space next to each other.
+uint64_t morton_code(const glm::vec3& unit);
+
+// Sorts 'keys' ascending and moves 'values' along with them (stable LSD radix sort, 8 bits per
+// pass, only over the low 'key_bits'). Big arrays are counted and scattered in chunks on the
+// shared thread pool; passes where every key has the same digit are skipped.
+void radix_sort(std::vector<uint64_t>& keys, std::vector<int>& values, int key_bits = 64);
@@ -1,3 +1,4 @@
+#include <algorithm>
 #include <cmath>
 #include <iostream>
 #include "object.h"
@@ -20,77 +21,145 @@
 //    this->shininess = shininess;
 //}
 
-Intersection Triangle::check_hit(Ray& r) {
-    // vertices of triangle
-    // (already transformed)
-    glm::vec3 a = get_vertex(0);
-    glm::vec3 b = get_vertex(1);
-    glm::vec3 c = get_vertex(2);
-
-    // check where ray intersects triangle plane
-    glm::vec3 tri_normal = glm::normalize(glm::cross(b - a, c - a));
-    float denom = glm::dot(r.direction, tri_normal);
-    // std::cout << "\ninside_checkhit_denom" << denom << "\n";
-    if (denom == 0.0f) { // check if parallel
-        return NoIntersection; // no hit
+void Object::check_hit_packet(RayPacket& packet, int mask) {
+    // one ray at a time; objects with their own BVH override this to keep the packet together
+    for (int k = 0; k < PACKET_SIZE; k++) {
+        if (!(mask & (1 << k))) {
+            continue;
+        }
+        Ray r = packet.get_ray(k);
+        Intersection inter = check_hit(r);
+        if (inter.hit_obj != nullptr && inter.distance < packet.t_max[k]) {
+            packet.hits[k] = inter;
+            packet.t_max[k] = inter.distance;
+        }
     }
+}
 
-    float t = glm::dot(a - r.origin, tri_normal) / denom; // finds "scale" 
-    
-    // std::cout << "\ninside_checkhit" << t << "\n";
-    if (t < 0) { // if t negative, then triangle is behind ray origin
+void Object::split_bounds(int axis, float pos, BoundingBox& left, BoundingBox& right) {
+    left = BoundingBox(get_xyz_extrema(false), get_xyz_extrema(true));
+    right = left;
+    left.c2[axis] = std::min(left.c2[axis], pos);
+    right.c1[axis] = std::max(right.c1[axis], pos);
+    if (left.c1[axis] > left.c2[axis]) left = BoundingBox::empty();
+    if (right.c1[axis] > right.c2[axis]) right = BoundingBox::empty();
+}
+
+Intersection Triangle::check_hit(Ray& r) {
+    // r is in object space (the Mesh instance moved it there), like the precomputed edges
+    float t;
+    if (!parent_mesh->intersect_triangle(tri_index, r, t)) {
         return NoIntersection; // no hit
     }
-    // otherwise, record the point of intersection
+
     Intersection inter(r.origin + t * r.direction);
-    
-    // use intersection point and check that it's within the triangle
-    // using inside-outside test
-    glm::vec3 ab = b - a;
-    glm::vec3 bc = c - b;
-    glm::vec3 ca = a - c;
-
-    glm::vec3 a_int = inter.hit - a; // vector between A and plane intersection point
-    glm::vec3 b_int = inter.hit - b;
-    glm::vec3 c_int = inter.hit - c;
-
-    // for each edge, the intersection point must be to the LEFT of each edge
-    if (glm::dot(tri_normal, glm::cross(ab, a_int)) > -1e-6f &&
-        glm::dot(tri_normal, glm::cross(bc, b_int)) > -1e-6f &&
-        glm::dot(tri_normal, glm::cross(ca, c_int)) > -1e-6f) {
-
-        // std::cout << "INTERSECTION AT(" << inter.hit.x << ", " << inter.hit.y << ", " << inter.hit.z << "\n";
-
-        inter.distance = t;
-        inter.hit_obj = this;
-        inter.normal = tri_normal;
-        // std::cout << "\nhit " << inter.distance << "\n";
-        return inter;
+    inter.distance = t;
+    inter.hit_obj = this;
+    inter.normal = parent_mesh->triangle_normal(tri_index);
+    return inter;
+}
+
+bool Triangle::check_occlusion(Ray& r) {
+    float t;
+    return parent_mesh->intersect_triangle(tri_index, r, t); // already bounded by r.t_max
+}
+
+Intersection MeshData::hit_instance(const glm::mat4& inverse, const glm::mat3& normal_matrix, Ray& r) {
+    // move the ray into object space; the direction is left unnormalized so 't' stays in world units
+    Ray local(
+        glm::vec3(inverse * glm::vec4(r.origin, 1.0f)),
+        glm::vec3(inverse * glm::vec4(r.direction, 0.0f))
+    );
+    local.t_max = r.t_max;
+    Intersection inter = check_hit(local);
+    if (inter.hit_obj == nullptr) {
+        return NoIntersection;
     }
 
-    // otherwise, not in triangle
-    return NoIntersection;
+    // back to world space
+    inter.hit = r.origin + inter.distance * r.direction;
+    inter.normal = glm::normalize(normal_matrix * inter.normal);
+    return inter;
+}
+
+bool MeshData::occluded_instance(const glm::mat4& inverse, Ray& r) {
+    // same object-space ray as hit_instance; t_max carries over because 't' is in world units
+    Ray local(
+        glm::vec3(inverse * glm::vec4(r.origin, 1.0f)),
+        glm::vec3(inverse * glm::vec4(r.direction, 0.0f))
+    );
+    local.t_max = r.t_max;
+    return check_occlusion(local);
+}
+
+void MeshData::hit_instance_packet(const glm::mat4& inverse, const glm::mat3& normal_matrix, RayPacket& packet, int mask) {
+    // an affine map keeps the packet coherent (and a shared origin shared), so trace it as one in object space
+    RayPacket local;
+    local.count = packet.count;
+    for (int k = 0; k < packet.count; k++) {
+        Ray r = packet.get_ray(k);
+        Ray l(
+            glm::vec3(inverse * glm::vec4(r.origin, 1.0f)),
+            glm::vec3(inverse * glm::vec4(r.direction, 0.0f))
+        );
+        l.t_max = r.t_max;
+        local.set_ray(k, l);
+    }
+    local.prepare();
+    check_hit_packet(local, mask);
+
+    for (int k = 0; k < PACKET_SIZE; k++) {
+        if (!(mask & (1 << k)) || local.hits[k].hit_obj == nullptr) {
+            continue;
+        }
+        Intersection inter = local.hits[k];
+        if (inter.distance < packet.t_max[k]) { // back to world space, as in hit_instance
+            Ray r = packet.get_ray(k);
+            inter.hit = r.origin + inter.distance * r.direction;
+            inter.normal = glm::normalize(normal_matrix * inter.normal);
+            packet.hits[k] = inter;
+            packet.t_max[k] = inter.distance;
+        }
+    }
 }
 
 Intersection Mesh::check_hit(Ray& r) {
-    // relies on Triangle::check_hit (from bvh)
-    // check bvh to find the triangle primitive intersecting with the ray
-    return this->bvh->locate(r);
+    return data->hit_instance(inverse_transform, normal_matrix, r);
+}
+
+bool Mesh::check_occlusion(Ray& r) {
+    return data->occluded_instance(inverse_transform, r);
+}
+
+void Mesh::check_hit_packet(RayPacket& packet, int mask) {
+    data->hit_instance_packet(inverse_transform, normal_matrix, packet, mask);
 }
 
 Intersection Sphere::check_hit(Ray& ray) {
+    float t;
+    glm::vec3 hit;
+    if (!intersect(transform, inverse_transform, radius, ray, t, hit)) {
+        return NoIntersection;
+    }
+    Intersection hitobj(hit);
+    hitobj.distance = t;
+    hitobj.hit_obj = this; // assign object hit 
+    hitobj.normal = normal_at(transform, inverse_transpose, hit);
+    return hitobj;
+}
+
+bool Sphere::intersect(const glm::mat4& transform, const glm::mat4& inverse, float radius, const Ray& ray, float& t, glm::vec3& hit) {
     // since sphere, extend to ellipse case using the inverse of transform
-    // 0.0f since already transformed using get_center() called below;
-    glm::vec3 new_orig = glm::inverse(transform) * glm::vec4(ray.origin, 0.0f);
-    glm::vec3 new_dir  = glm::inverse(transform) * glm::vec4(ray.direction, 0.0f);
+    // 0.0f since already transformed using the center computed below;
+    glm::vec3 new_orig = inverse * glm::vec4(ray.origin, 0.0f);
+    glm::vec3 new_dir  = inverse * glm::vec4(ray.direction, 0.0f);
     Ray r(new_orig, glm::normalize(new_dir)); 
-    glm::vec3 world_hit(0.0f); // going back to world coordinates for ellipse
     
     // solve quadratic equation for 't': 
     // (P1 dot P1)t^2 + 2*(P1 dot (P0 - C))t + (P0 - C) dot (P0 - C) - r^2 = 0
     glm::vec3 p0 = r.origin;
     glm::vec3 p1 = r.direction;
-    glm::vec3 center = transform * glm::vec4(this->get_center(), 0.0f);
+    glm::vec3 center = transform * glm::vec4(glm::vec3(transform[3]), 0.0f);
 
 
     // in quadratic notation
@@ -100,62 +169,69 @@ Intersection Sphere::check_hit(Ray& ray) {
     
     // look at determinant first
     float det = glm::sqrt(glm::pow(b, 2) - (4.0f * a * c));
-    Intersection hitobj(p0);
 
     if (std::isnan(det) || det < 0.0f) { // no real root case
-        // std::cout << "NULLHITdet: " << det << ".\n";
-
-        return NoIntersection; // NULL hit
+        return false; // NULL hit
     }
     else if (det == 0.0f) { // only one intersection (tangent case)
         // tangent + positive/negative case
         float root1 = (-b + det) / (2.0f * a);
         float root2 = (-b - det) / (2.0f * a);
-        // std::cout << "ONEHITdet: " << det << ".\n";
 
         if (root1 == root2) { // unique root
-            world_hit = transform * glm::vec4(p0 + (p1 * root1), 1.0f);
-            hitobj.hit = world_hit;
-            hitobj.distance = root1;
+            hit = transform * glm::vec4(p0 + (p1 * root1), 1.0f);
+            t = root1;
         }
         else {
-            world_hit = transform * glm::vec4((std::isnan(root1)) ? p0 + (p1 * root2) : p0 + (p1 * root1), 1.0f);
-            hitobj.hit = world_hit;
-            hitobj.distance = (std::isnan(root1)) ? root2 : root1;
+            hit = transform * glm::vec4((std::isnan(root1)) ? p0 + (p1 * root2) : p0 + (p1 * root1), 1.0f);
+            t = (std::isnan(root1)) ? root2 : root1;
         }
     }
     else { // two intersections (det > 0)
         float root1 = (-b + det) / (2.0f * a);
         float root2 = (-b - det) / (2.0f * a);
-        // std::cout << "TWOHITdet: " << det << ".\n";
 
-        world_hit = transform * glm::vec4(p0 + (p1 * std::min(root1, root2)), 1.0f);
-        hitobj.hit = world_hit; // take the one nearest to us
-        hitobj.distance = std::min(root2, root1);
+        float near_root = std::min(root1, root2);
+        if (near_root < 0.0f) { // origin inside the sphere, the far root is the exit
+            near_root = std::max(root1, root2);
+        }
+        hit = transform * glm::vec4(p0 + (p1 * near_root), 1.0f); // going back to world coordinates for ellipse
+        t = near_root;
+    }
+
+    if (t < 0.0f) { // sphere is behind the ray
+        return false;
     }
+    // 'r' runs along the normalized local direction; rescale so distances compare with other objects
+    t /= glm::length(new_dir);
+    return !(t > ray.t_max); // not farther than a hit we already have
+}
 
-    hitobj.hit_obj = this; // assign object hit 
-    glm::vec3 normal = glm::normalize(hitobj.hit - center);
-    hitobj.normal = glm::normalize(glm::vec3(glm::transpose(glm::inverse(transform)) * glm::vec4(normal, 0.0f)));
+glm::vec3 Sphere::normal_at(const glm::mat4& transform, const glm::mat4& inverse_transpose, const glm::vec3& hit) {
+    glm::vec3 center = transform * glm::vec4(glm::vec3(transform[3]), 0.0f);
+    glm::vec3 normal = glm::normalize(hit - center);
+    return glm::normalize(glm::vec3(inverse_transpose * glm::vec4(normal, 0.0f)));
+}
 
-    //std::cout<< "worldhit: " << world_hit.x << ", " << world_hit.y << ", " << world_hit.z << "\n";
 
-    return hitobj;
+float Mesh::intersect_cost() {
+    // moving the ray into object space, then the expected cost of the mesh BVH for a ray that hits its box
+    return SAH_TRAVERSAL_COST + data->get_bvh()->get_build_sah();
 }
 
-
 glm::vec3 Mesh::get_xyz_extrema(bool maximum) {
-    // go through every vertex, find maximum/minimum
+    // transform the 8 corners of the object-space bounds, find maximum/minimum
+    BoundingBox box = data->bounds();
     glm::vec3 obj_xyz(maximum ? INT_MIN : INT_MAX); // init
-    for (int i = 0; i < vertices.size(); i++) {
-        if (maximum) {
-            obj_xyz = glm::max(glm::vec3(transform * glm::vec4(vertices[i], 1.0f)), obj_xyz);
-        }
-        else {
-            obj_xyz = glm::min(glm::vec3(transform * glm::vec4(vertices[i], 1.0f)), obj_xyz);
-        }
+    for (int i = 0; i < 8; i++) {
+        glm::vec3 corner(
+            (i & 1) ? box.c2.x : box.c1.x,
+            (i & 2) ? box.c2.y : box.c1.y,
+            (i & 4) ? box.c2.z : box.c1.z
+        );
+        glm::vec3 world = glm::vec3(transform * glm::vec4(corner, 1.0f));
+        obj_xyz = (maximum) ? glm::max(world, obj_xyz) : glm::min(world, obj_xyz);
     }
-    std::cout << "MESH::getexetrema objxyz: (" << obj_xyz.x << ", " << obj_xyz.y << ", " << obj_xyz.z << ")\n.";
 
     return obj_xyz;
 }
@@ -174,13 +250,32 @@ glm::vec3 Sphere::get_xyz_extrema(bool maximum) {
     return (maximum) ? obj_xyz + (radius * scales) : obj_xyz - (radius * scales);
 }
 
+void Triangle::split_bounds(int axis, float pos, BoundingBox& left, BoundingBox& right) {
+    // walk the edges: every vertex goes to its side, an edge crossing the plane adds the
+    // crossing point to both
+    left = BoundingBox::empty();
+    right = BoundingBox::empty();
+    glm::vec3 v[3] = { get_vertex(0), get_vertex(1), get_vertex(2) };
+    for (int k = 0; k < 3; k++) {
+        const glm::vec3& a = v[k];
+        const glm::vec3& b = v[(k + 1) % 3];
+        if (a[axis] <= pos) left.expand(a);
+        if (a[axis] >= pos) right.expand(a);
+        if ((a[axis] < pos && b[axis] > pos) || (a[axis] > pos && b[axis] < pos)) {
+            glm::vec3 p = glm::mix(a, b, (pos - a[axis]) / (b[axis] - a[axis]));
+            p[axis] = pos;
+            left.expand(p);
+            right.expand(p);
+        }
+    }
+}
+
 glm::vec3 Triangle::get_xyz_extrema(bool maximum) {
     glm::vec3 tri_xyz(maximum ? INT_MIN : INT_MAX); // init
-    std::vector<glm::vec3>* vertices = parent_mesh->get_vertices();
 
-    glm::vec3 a = transform * glm::vec4((*vertices).at(static_cast<int>(idx.x)), 1.0f);
-    glm::vec3 b = transform * glm::vec4((*vertices).at(static_cast<int>(idx.y)), 1.0f);
-    glm::vec3 c = transform * glm::vec4((*vertices).at(static_cast<int>(idx.z)), 1.0f);
+    glm::vec3 a = get_vertex(0);
+    glm::vec3 b = get_vertex(1);
+    glm::vec3 c = get_vertex(2);
 
     if (maximum) {
         tri_xyz = glm::max(a, tri_xyz);
@@ -193,8 +288,6 @@ glm::vec3 Triangle::get_xyz_extrema(bool maximum) {
         tri_xyz = glm::min(c, tri_xyz);
     }
 
-    std::cout << "MESH::getexetrema trixyz: (" << tri_xyz.x << ", " << tri_xyz.y << ", " << tri_xyz.z << ")\n.";
-
     return tri_xyz;
 }
 
@@ -202,9 +295,7 @@ glm::vec3 Triangle::get_xyz_extrema(bool maximum) {
 // TRIANGLES CAN HAVE THEIR OWN.
 Triangle::Triangle(
     glm::vec3 idx_, 
-    Mesh* parent,
-    ObjectType type,
-    glm::mat4 transform,
+    MeshData* parent,
     glm::vec3 ambient,
     glm::vec3 diffuse,
     glm::vec3 specular,
@@ -212,7 +303,7 @@ Triangle::Triangle(
     float shininess
 ) : Object(
         TRIANGLE,
-        transform,
+        glm::mat4(1.0f), // placed in the world by its Mesh instance
         ambient,
         diffuse,
         specular,
@@ -224,35 +315,88 @@ Triangle::Triangle(
     this->parent_mesh = parent;
 }
 
-void Triangle::assign_parent(Mesh* p) {
+void Triangle::assign_parent(MeshData* p, int index) {
     parent_mesh = p;
+    tri_index = index;
 }
 
 glm::vec3 Triangle::get_vertex(int v) {
-    // returns transformed vertices
+    // returns object-space vertices
     if (v > 3 || v < 0) {
         throw "get_vertex must be in range 0-2, inclusive.";
     }
     int vertex_idx = idx[v];
-    glm::vec4 ret = transform * glm::vec4(parent_mesh->get_vertices()->at(vertex_idx), 1);
-    return glm::vec3(ret);
+    return parent_mesh->get_vertices()->at(vertex_idx);
+}
+
+bool Triangle::same_surface(Triangle* other) {
+    return idx == other->idx && ambient == other->ambient && diffuse == other->diffuse &&
+        specular == other->specular && emission == other->emission && shininess == other->shininess;
+}
+
+MeshData::MeshData(std::vector<glm::vec3> vertices, std::vector<Triangle*> triangles, BVHBuildOptions bvh_options) : vertices(vertices) {
+    std::vector<PrimRef> refs;
+    refs.reserve(triangles.size());
+    for (size_t i = 0; i < triangles.size(); i++) {
+        triangles[i]->assign_parent(this, static_cast<int>(i));
+        this->triangles.push_back(triangles[i]);
+
+        // everything the hit test needs, so it never touches the index/vertex lists
+        refs.push_back(prims.add_triangle(triangles[i],
+            triangles[i]->get_vertex(0), triangles[i]->get_vertex(1), triangles[i]->get_vertex(2)));
+    }
+    bvh = new BVH<PrimRef>(refs, bvh_options, &prims); // object space, built once for every instance
+    bvh->print_summary("mesh"); // build time per mesh
+}
+
+MeshData::~MeshData() {
+    for (auto& tri : triangles) {
+        delete tri;
+    }
+    delete bvh;
+}
+
+bool MeshData::matches(const std::vector<glm::vec3>& other_vertices, const std::vector<Triangle*>& other_triangles) {
+    if (vertices.size() != other_vertices.size() || triangles.size() != other_triangles.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < vertices.size(); i++) {
+        if (vertices[i] != other_vertices[i]) {
+            return false;
+        }
+    }
+    for (size_t i = 0; i < triangles.size(); i++) {
+        if (!triangles[i]->same_surface(other_triangles[i])) {
+            return false;
+        }
+    }
+    return true;
 }
 
 Mesh::Mesh(
-    std::vector<glm::vec3> vertices,
-    std::vector<Triangle*> triangles,
+    std::shared_ptr<MeshData> data,
     glm::mat4 transform,
     glm::vec3 ambient,
     glm::vec3 diffuse,
     glm::vec3 specular,
     glm::vec3 emission,
     float shininess
-) : Object(ObjectType::TRIANGLE, transform, ambient, diffuse, specular, emission, shininess), vertices(vertices) {
-    for (int i = 0; i < triangles.size(); i++) {
-        triangles[i]->assign_parent(this);
-        this->triangles.push_back(triangles[i]);
+) : Object(ObjectType::TRIANGLE, transform, ambient, diffuse, specular, emission, shininess), data(data) {
+    update_inverses();
+};
+
+void Mesh::set_transform(glm::mat4 t) {
+    transform = t;
+    version++;
+    update_inverses();
+}
+
+void Mesh::update_inverses() {
+    inverse_transform = glm::inverse(transform);
+    glm::mat3 linear(transform);
+    // inverse transpose keeps normals perpendicular; mirrored transforms also flip the winding
+    normal_matrix = glm::transpose(glm::inverse(linear));
+    if (glm::determinant(linear) < 0.0f) {
+        normal_matrix = normal_matrix * -1.0f;
     }
-    bvh = new BVH<Triangle*>(this->triangles);
-    std::cout << "\n\nMAKING TRIANGLE/MESH bvh:\n";
-    bvh->display();
-};
\ No newline at end of file
+}
\ No newline at end of file
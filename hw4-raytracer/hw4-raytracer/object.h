@@ -1,13 +1,15 @@
 #pragma once
 
-#include <GLFW/glfw3.h>
 #include <glm/glm.hpp>
 #include <vector>
+#include <memory>
 #include "bvh.h"
+#include "primitives.h"
 #include "ray.h"
 
 class Object;
 class Triangle;
+class MeshData;
 class Mesh;
 
 class Object {
@@ -19,6 +21,7 @@ protected:
     glm::vec3 specular;
     glm::vec3 emission;
     float shininess;
+    unsigned long long version = 0; // bumped on every change to how the object looks, see Scene::get_version
     
 public:
     Object(
@@ -31,6 +34,7 @@ public:
         float shininess
     ) : type(type), transform(transform), ambient(ambient), diffuse(diffuse),
         specular(specular), emission(emission), shininess(shininess) {};
+    virtual ~Object() {};
     ObjectType get_type() { return type; }
     glm::mat4 get_transform() { return transform; }
     glm::vec3 get_ambient() { return ambient; }
@@ -38,24 +42,35 @@ public:
     glm::vec3 get_specular() { return specular; }
     glm::vec3 get_emission() { return emission; }
     float get_shininess() { return shininess; }
+    unsigned long long get_version() { return version; }
+
+    virtual void set_transform(glm::mat4 t) { transform = t; version++; } // subclasses refresh their cached matrices
 
     virtual Intersection check_hit(Ray& r) = 0; // different intersection algorithms for each object type
+    // any hit closer than r.t_max; shadow rays only need a yes/no, so subclasses can skip the closest-hit work
+    virtual bool check_occlusion(Ray& r) { return check_hit(r).hit_obj != nullptr; }
+    // closest hits for the packet rays in 'mask', kept only where nearer than the ray's t_max
+    virtual void check_hit_packet(RayPacket& packet, int mask);
     virtual glm::vec3 get_xyz_extrema(bool maximum) = 0; // for bounding boxes
+    // cost of check_hit for the BVH builder's SAH, in units of one primitive test
+    virtual float intersect_cost() { return SAH_INTERSECT_COST; }
+    // bounds of the parts on either side of the plane where coordinate 'axis' == pos, for spatial
+    // splits in the BVH build; the default just cuts the bounding box, exact shapes do better
+    virtual void split_bounds(int axis, float pos, BoundingBox& left, BoundingBox& right);
 };
 
 class Triangle : public Object {
 private:
     // we assume that all Triangles generated are part of a Mesh
-    // pointer saves memory with "global-to-triangle" properties though may be bad practice
-    Mesh* parent_mesh = nullptr;
+    // vertices live in the shared, object-space MeshData; Mesh instances place them in the world
+    MeshData* parent_mesh = nullptr;
     glm::vec3 idx; // vertex component indices
+    int tri_index = -1; // slot in the parent's precomputed intersection buffers
 
 public:
     Triangle(
         glm::vec3 idx_,
-        Mesh* parent,
-        ObjectType type,
-        glm::mat4 transform,
+        MeshData* parent,
         glm::vec3 ambient,
         glm::vec3 diffuse,
         glm::vec3 specular,
@@ -63,23 +78,59 @@ public:
         float shininess
     );
 
-    Intersection check_hit(Ray& r);
+    Intersection check_hit(Ray& r); // r in object space of the parent mesh
+    bool check_occlusion(Ray& r);
     glm::vec3 get_xyz_extrema(bool maximum);
-    void assign_parent(Mesh* p);
-    glm::vec3 get_vertex(int v); // returns the vertex 'v' (0,1,2)
+    void split_bounds(int axis, float pos, BoundingBox& left, BoundingBox& right); // clips the triangle itself
+    void assign_parent(MeshData* p, int index);
+    glm::vec3 get_vertex(int v); // returns the object-space vertex 'v' (0,1,2)
+    glm::vec3 get_indices() { return idx; }
+    bool same_surface(Triangle* other); // same vertex indices and material
 };
 
-// Mesh is made of triangle components, therefore type==TRIANGLE
-class Mesh : public Object {
+// Geometry of a mesh in object space, with its BVH built once.
+// Any number of Mesh instances share one MeshData (two-level acceleration structure).
+class MeshData {
 private:
-    BVH<Triangle*>* bvh;
+    BVH<PrimRef>* bvh;
     std::vector<glm::vec3> vertices; // set of all triangle primitive vertex components
     std::vector<Triangle*> triangles; // made of indices of vertices
+    PrimitiveStore prims; // per-triangle intersection data, precomputed at load (slot tri_index)
+
+public:
+    MeshData(std::vector<glm::vec3> vertices, std::vector<Triangle*> triangles, BVHBuildOptions bvh_options = BVHBuildOptions());
+    ~MeshData();
+
+    bool intersect_triangle(int k, const Ray& r, float& t) { return prims.intersect_triangle(k, r, t); }
+    glm::vec3 triangle_normal(int k) { return prims.triangle_normal(k); }
+
+    Intersection check_hit(Ray& r) { return bvh->locate(r); }
+    bool check_occlusion(Ray& r) { return bvh->occluded(r, r.t_max); }
+    void check_hit_packet(RayPacket& packet, int mask) { bvh->locate_packet(packet, mask); }
+    // the same for an instance: world rays are moved into object space with 'inverse' (left
+    // unnormalized, so 't' stays in world units), hits come back with 'normal_matrix'
+    Intersection hit_instance(const glm::mat4& inverse, const glm::mat3& normal_matrix, Ray& r);
+    bool occluded_instance(const glm::mat4& inverse, Ray& r);
+    void hit_instance_packet(const glm::mat4& inverse, const glm::mat3& normal_matrix, RayPacket& packet, int mask);
+    BoundingBox bounds() { return bvh->bounds(); }
+    bool matches(const std::vector<glm::vec3>& other_vertices, const std::vector<Triangle*>& other_triangles);
+    std::vector<glm::vec3>* get_vertices() { return &vertices; }
+    int triangle_count() { return static_cast<int>(triangles.size()); }
+    BVH<PrimRef>* get_bvh() { return bvh; }
+};
+
+// Mesh is an instance of shared MeshData placed by its transform, therefore type==TRIANGLE
+class Mesh : public Object {
+private:
+    std::shared_ptr<MeshData> data;
+    glm::mat4 inverse_transform; // world -> object space, for rays
+    glm::mat3 normal_matrix;     // object -> world space, for normals
+
+    void update_inverses();
 
 public:
     Mesh(
-        std::vector<glm::vec3> vertices,
-        std::vector<Triangle*> triangles,
+        std::shared_ptr<MeshData> data,
         glm::mat4 transform,
         glm::vec3 ambient,
         glm::vec3 diffuse,
@@ -88,22 +139,29 @@ public:
         float shininess
     );
 
-    ~Mesh() {
-        for (auto& tri : triangles) {
-            delete tri;
-        }
-        delete bvh;
-    }
-    
+    void set_transform(glm::mat4 t);
     Intersection check_hit(Ray& r);
+    bool check_occlusion(Ray& r);
+    void check_hit_packet(RayPacket& packet, int mask);
     glm::vec3 get_xyz_extrema(bool maximum);
-    std::vector<glm::vec3>* get_vertices() { return &vertices; }
+    float intersect_cost(); // a query of the mesh BVH
+    std::shared_ptr<MeshData> get_data() { return data; }
+    glm::mat4 get_inverse_transform() { return inverse_transform; }
+    glm::mat3 get_normal_matrix() { return normal_matrix; }
 };
 
 
 class Sphere : public Object {
 private:
     float radius;
+    // cached once per transform instead of inverting inside every ray test
+    glm::mat4 inverse_transform;
+    glm::mat4 inverse_transpose; // for normals
+
+    void update_inverses() {
+        inverse_transform = glm::inverse(transform);
+        inverse_transpose = glm::transpose(inverse_transform);
+    }
 
 public:
     Sphere(
@@ -115,10 +173,20 @@ public:
         glm::vec3 emission,
         float shininess
     ) : Object(ObjectType::SPHERE, transform, ambient, diffuse, specular, emission, shininess),
-        radius(radius) {};
+        radius(radius) {
+        update_inverses();
+    };
 
+    void set_transform(glm::mat4 t) { transform = t; version++; update_inverses(); }
     float get_radius() { return radius; }
     glm::vec3 get_center() { return glm::vec3(transform[3][0], transform[3][1], transform[3][2]); }
+    glm::mat4 get_inverse_transform() { return inverse_transform; }
+    glm::mat4 get_inverse_transpose() { return inverse_transpose; }
     Intersection check_hit(Ray& r);
     glm::vec3 get_xyz_extrema(bool maximum);
+
+    // the ray test on its own, for spheres kept in a PrimitiveStore: on a hit closer than
+    // ray.t_max, 'hit' is the world point and 't' its distance along ray.direction
+    static bool intersect(const glm::mat4& transform, const glm::mat4& inverse, float radius, const Ray& ray, float& t, glm::vec3& hit);
+    static glm::vec3 normal_at(const glm::mat4& transform, const glm::mat4& inverse_transpose, const glm::vec3& hit);
 };
\ No newline at end of file
@@ -0,0 +1,257 @@
+#include <cassert>
+
+#include "primitives.h"
+#include "object.h"
+
+PrimRef PrimitiveStore::add(Object* obj) {
+	PrimType type = PRIM_OBJECT;
+	if (dynamic_cast<Sphere*>(obj) != nullptr) {
+		type = PRIM_SPHERE;
+	}
+	else if (dynamic_cast<Mesh*>(obj) != nullptr) {
+		type = PRIM_INSTANCE;
+	}
+
+	// reuse a released slot of the same type, else append one to every array of the type
+	PrimRef ref;
+	if (!free_slots[type].empty()) {
+		ref = PrimRef(type, free_slots[type].back());
+		free_slots[type].pop_back();
+	}
+	else if (type == PRIM_SPHERE) {
+		assert(sphere_owner.size() < PRIM_INDEX_LIMIT);
+		ref = PrimRef(type, static_cast<int>(sphere_owner.size()));
+		sphere_transform.emplace_back();
+		sphere_inverse.emplace_back();
+		sphere_inverse_transpose.emplace_back();
+		sphere_radius.emplace_back();
+		sphere_owner.emplace_back();
+	}
+	else if (type == PRIM_INSTANCE) {
+		assert(inst_owner.size() < PRIM_INDEX_LIMIT);
+		ref = PrimRef(type, static_cast<int>(inst_owner.size()));
+		inst_inverse.emplace_back();
+		inst_normal.emplace_back();
+		inst_data.emplace_back();
+		inst_owner.emplace_back();
+	}
+	else {
+		assert(other_owner.size() < PRIM_INDEX_LIMIT);
+		ref = PrimRef(type, static_cast<int>(other_owner.size()));
+		other_owner.emplace_back();
+	}
+	load(ref, obj);
+	refs[obj] = ref;
+	return ref;
+}
+
+void PrimitiveStore::load(PrimRef ref, Object* obj) {
+	int k = ref.index();
+	switch (ref.type()) {
+	case PRIM_SPHERE: {
+		Sphere* sphere = static_cast<Sphere*>(obj);
+		sphere_transform[k] = sphere->get_transform();
+		sphere_inverse[k] = sphere->get_inverse_transform();
+		sphere_inverse_transpose[k] = sphere->get_inverse_transpose();
+		sphere_radius[k] = sphere->get_radius();
+		sphere_owner[k] = sphere;
+		break;
+	}
+	case PRIM_INSTANCE: {
+		Mesh* mesh = static_cast<Mesh*>(obj);
+		inst_inverse[k] = mesh->get_inverse_transform();
+		inst_normal[k] = mesh->get_normal_matrix();
+		inst_data[k] = mesh->get_data().get();
+		inst_owner[k] = mesh;
+		break;
+	}
+	case PRIM_OBJECT:
+		other_owner[k] = obj;
+		break;
+	default:
+		break; // triangles only come in through add_triangle
+	}
+}
+
+PrimRef PrimitiveStore::add_triangle(Triangle* tri, const glm::vec3& a, const glm::vec3& b, const glm::vec3& c) {
+	assert(tri_owner.size() < PRIM_INDEX_LIMIT);
+	PrimRef ref(PRIM_TRIANGLE, static_cast<int>(tri_owner.size()));
+	tri_v0.push_back(a);
+	tri_e1.push_back(b - a);
+	tri_e2.push_back(c - a);
+	tri_normal.push_back(glm::normalize(glm::cross(b - a, c - a)));
+	tri_owner.push_back(tri);
+	return ref;
+}
+
+bool PrimitiveStore::find(Object* obj, PrimRef& ref) {
+	auto found = refs.find(obj);
+	if (found == refs.end()) {
+		return false;
+	}
+	ref = found->second;
+	return true;
+}
+
+void PrimitiveStore::remove(PrimRef ref) {
+	Object* obj = owner(ref);
+	if (obj == nullptr) {
+		return; // already released
+	}
+	refs.erase(obj);
+	int k = ref.index();
+	switch (ref.type()) {
+	case PRIM_SPHERE: sphere_owner[k] = nullptr; break;
+	case PRIM_INSTANCE: inst_owner[k] = nullptr; inst_data[k] = nullptr; break;
+	case PRIM_OBJECT: other_owner[k] = nullptr; break;
+	default: return; // triangles stay with their mesh
+	}
+	free_slots[ref.type()].push_back(k);
+}
+
+void PrimitiveStore::refresh() {
+	for (auto& entry : refs) {
+		load(entry.second, entry.first);
+	}
+}
+
+void PrimitiveStore::clear() {
+	*this = PrimitiveStore();
+}
+
+Object* PrimitiveStore::owner(PrimRef ref) const {
+	int k = ref.index();
+	switch (ref.type()) {
+	case PRIM_SPHERE: return sphere_owner[k];
+	case PRIM_TRIANGLE: return tri_owner[k];
+	case PRIM_INSTANCE: return inst_owner[k];
+	default: return other_owner[k];
+	}
+}
+
+Object* prim_object(const PrimitiveStore* store, PrimRef ref) {
+	return store->owner(ref);
+}
+
+void PrimitiveStore::hit(const PrimRef* prims, int count, Ray& ray, Intersection& closest) const {
+	// leaves are sorted by type, so every case runs over the whole group before switching again
+	int i = 0;
+	while (i < count) {
+		PrimType type = prims[i].type();
+		switch (type) {
+		case PRIM_SPHERE:
+			for (; i < count && prims[i].type() == PRIM_SPHERE; i++) {
+				int k = prims[i].index();
+				float t;
+				glm::vec3 p;
+				if (Sphere::intersect(sphere_transform[k], sphere_inverse[k], sphere_radius[k], ray, t, p) && t < ray.t_max) {
+					closest = Intersection(p, Sphere::normal_at(sphere_transform[k], sphere_inverse_transpose[k], p), sphere_owner[k]);
+					closest.distance = t;
+					ray.t_max = t;
+				}
+			}
+			break;
+		case PRIM_TRIANGLE:
+			for (; i < count && prims[i].type() == PRIM_TRIANGLE; i++) {
+				int k = prims[i].index();
+				float t;
+				if (intersect_triangle(k, ray, t) && t < ray.t_max) {
+					closest = Intersection(ray.origin + t * ray.direction, tri_normal[k], tri_owner[k]);
+					closest.distance = t;
+					ray.t_max = t;
+				}
+			}
+			break;
+		case PRIM_INSTANCE:
+			for (; i < count && prims[i].type() == PRIM_INSTANCE; i++) {
+				int k = prims[i].index();
+				Intersection inter = inst_data[k]->hit_instance(inst_inverse[k], inst_normal[k], ray);
+				if (inter.hit_obj != nullptr && inter.distance < ray.t_max) {
+					closest = inter;
+					ray.t_max = inter.distance;
+				}
+			}
+			break;
+		default:
+			for (; i < count && prims[i].type() == type; i++) {
+				Intersection inter = other_owner[prims[i].index()]->check_hit(ray);
+				if (inter.hit_obj != nullptr && inter.distance < ray.t_max) {
+					closest = inter;
+					ray.t_max = inter.distance;
+				}
+			}
+			break;
+		}
+	}
+}
+
+bool PrimitiveStore::occluded(const PrimRef* prims, int count, Ray& ray) const {
+	int i = 0;
+	while (i < count) {
+		PrimType type = prims[i].type();
+		switch (type) {
+		case PRIM_SPHERE:
+			for (; i < count && prims[i].type() == PRIM_SPHERE; i++) {
+				int k = prims[i].index();
+				float t;
+				glm::vec3 p;
+				if (Sphere::intersect(sphere_transform[k], sphere_inverse[k], sphere_radius[k], ray, t, p)) {
+					return true;
+				}
+			}
+			break;
+		case PRIM_TRIANGLE:
+			for (; i < count && prims[i].type() == PRIM_TRIANGLE; i++) {
+				float t;
+				if (intersect_triangle(prims[i].index(), ray, t)) { // already bounded by ray.t_max
+					return true;
+				}
+			}
+			break;
+		case PRIM_INSTANCE:
+			for (; i < count && prims[i].type() == PRIM_INSTANCE; i++) {
+				int k = prims[i].index();
+				if (inst_data[k]->occluded_instance(inst_inverse[k], ray)) {
+					return true;
+				}
+			}
+			break;
+		default:
+			for (; i < count && prims[i].type() == type; i++) {
+				if (other_owner[prims[i].index()]->check_occlusion(ray)) {
+					return true;
+				}
+			}
+			break;
+		}
+	}
+	return false;
+}
+
+void PrimitiveStore::hit_packet(const PrimRef* prims, int count, RayPacket& packet, int mask) const {
+	for (int i = 0; i < count; i++) {
+		int k = prims[i].index();
+		switch (prims[i].type()) {
+		case PRIM_INSTANCE: // stays a packet in object space
+			inst_data[k]->hit_instance_packet(inst_inverse[k], inst_normal[k], packet, mask);
+			break;
+		case PRIM_OBJECT:
+			other_owner[k]->check_hit_packet(packet, mask);
+			break;
+		default: // spheres and triangles: one ray at a time
+			for (int r = 0; r < PACKET_SIZE; r++) {
+				if (!(mask & (1 << r))) {
+					continue;
+				}
+				Ray ray = packet.get_ray(r);
+				Intersection inter;
+				hit(&prims[i], 1, ray, inter);
+				if (inter.hit_obj != nullptr) { // hit() only keeps hits nearer than the ray's t_max
+					packet.hits[r] = inter;
+					packet.t_max[r] = inter.distance;
+				}
+			}
+			break;
+		}
+	}
+}
@@ -0,0 +1,145 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <cstdint>
+#include <functional>
+#include <unordered_map>
+#include <vector>
+#include "bvh.h"
+#include "ray.h"
+
+class Object;
+class Sphere;
+class Triangle;
+class MeshData;
+class Mesh;
+
+// kinds of primitives in a PrimitiveStore; also the order of the groups within a BVH leaf
+enum PrimType {
+	PRIM_SPHERE,
+	PRIM_TRIANGLE,
+	PRIM_INSTANCE, // a Mesh: its MeshData's BVH, placed by a transform
+	PRIM_OBJECT,   // any other Object, tested through its virtual functions
+};
+
+const size_t PRIM_INDEX_LIMIT = size_t(1) << 30; // slots per type that fit below the type bits of a PrimRef
+
+// Typed index into a PrimitiveStore: the type in the top two bits, the slot in that type's
+// arrays below. This is what the leaves of a BVH<PrimRef> hold instead of Object pointers.
+struct PrimRef {
+	uint32_t bits = 0;
+
+	PrimRef() = default;
+	PrimRef(PrimType type, int index) : bits((static_cast<uint32_t>(type) << 30) | static_cast<uint32_t>(index)) {}
+	PrimType type() const { return static_cast<PrimType>(bits >> 30); }
+	int index() const { return static_cast<int>(bits & 0x3FFFFFFF); }
+	bool operator==(const PrimRef& other) const { return bits == other.bits; }
+	bool operator!=(const PrimRef& other) const { return bits != other.bits; }
+};
+
+namespace std {
+	template <>
+	struct hash<PrimRef> {
+		size_t operator()(const PrimRef& ref) const { return hash<uint32_t>()(ref.bits); }
+	};
+}
+
+// Primitives kept by type in contiguous arrays, one array per field, so the leaf tests of a BVH
+// switch on the type of a PrimRef and read only the fields they need (the object pointers are
+// only read on a hit, for materials). The Scene keeps its spheres and mesh instances here, every
+// MeshData its triangles. The objects still own their data: refresh() copies moved transforms in.
+class PrimitiveStore {
+private:
+	// spheres (world space); see Sphere::intersect
+	std::vector<glm::mat4> sphere_transform;
+	std::vector<glm::mat4> sphere_inverse;
+	std::vector<glm::mat4> sphere_inverse_transpose; // normals, on a hit
+	std::vector<float> sphere_radius;
+	std::vector<Sphere*> sphere_owner;
+
+	// triangles (object space of their mesh), everything Moller-Trumbore needs
+	std::vector<glm::vec3> tri_v0;     // first vertex
+	std::vector<glm::vec3> tri_e1;     // v1 - v0
+	std::vector<glm::vec3> tri_e2;     // v2 - v0
+	std::vector<glm::vec3> tri_normal; // normalized cross(e1, e2)
+	std::vector<Triangle*> tri_owner;
+
+	// mesh instances
+	std::vector<glm::mat4> inst_inverse; // world -> object space, for rays
+	std::vector<glm::mat3> inst_normal;  // object -> world space, for normals
+	std::vector<MeshData*> inst_data;
+	std::vector<Mesh*> inst_owner;
+
+	std::vector<Object*> other_owner;
+
+	std::unordered_map<Object*, PrimRef> refs; // objects added with add()
+	std::vector<int> free_slots[4]; // per PrimType, released by remove() and reused by add()
+	void load(PrimRef ref, Object* obj); // copies the object's current state into its slot
+
+public:
+	PrimRef add(Object* obj); // a sphere, mesh instance or anything else, placed in the world
+	PrimRef add_triangle(Triangle* tri, const glm::vec3& a, const glm::vec3& b, const glm::vec3& c);
+	bool find(Object* obj, PrimRef& ref); // false if obj was not added
+	void remove(PrimRef ref); // the slot keeps nothing of the object
+	void refresh(); // after objects moved: reloads every slot added with add()
+	void clear();
+	int triangle_count() { return static_cast<int>(tri_v0.size()); }
+
+	Object* owner(PrimRef ref) const;
+	bool intersect_triangle(int k, const Ray& r, float& t) const; // Moller-Trumbore; t along r.direction
+	glm::vec3 triangle_normal(int k) const { return tri_normal[k]; }
+
+	// one leaf's primitives, grouped by type: each group runs through its own loop
+	void hit(const PrimRef* prims, int count, Ray& ray, Intersection& closest) const;
+	bool occluded(const PrimRef* prims, int count, Ray& ray) const;
+	void hit_packet(const PrimRef* prims, int count, RayPacket& packet, int mask) const;
+};
+
+inline bool PrimitiveStore::intersect_triangle(int k, const Ray& r, float& t) const {
+	// Moller-Trumbore: solve origin + t*dir = v0 + u*e1 + v*e2, barycentrics computed once
+	const glm::vec3& e1 = tri_e1[k];
+	const glm::vec3& e2 = tri_e2[k];
+
+	glm::vec3 pvec = glm::cross(r.direction, e2);
+	float det = glm::dot(e1, pvec);
+	if (det == 0.0f) { // check if parallel
+		return false;
+	}
+	float inv_det = 1.0f / det;
+
+	glm::vec3 tvec = r.origin - tri_v0[k];
+	float u = glm::dot(tvec, pvec) * inv_det;
+	if (u < 0.0f || u > 1.0f) {
+		return false;
+	}
+
+	glm::vec3 qvec = glm::cross(tvec, e1);
+	float v = glm::dot(r.direction, qvec) * inv_det;
+	if (v < 0.0f || u + v > 1.0f) {
+		return false;
+	}
+
+	t = glm::dot(e2, qvec) * inv_det;
+	return t >= 0.0f && t <= r.t_max; // if t negative, then triangle is behind ray origin
+}
+
+// How a BVH<PrimRef> reaches its primitives. Build, refit and edits only need the object behind one:
+Object* prim_object(const PrimitiveStore* store, PrimRef ref);
+
+// leaves are sorted by this: by type, then slot (neighbours in the arrays)
+inline uint32_t leaf_key(PrimRef ref) {
+	return ref.bits;
+}
+
+// leaf tests: closest hit (shrinking ray.t_max to it), any hit before ray.t_max, packet closest hits
+inline void hit_leaf(const PrimitiveStore* store, const PrimRef* prims, int count, Ray& ray, Intersection& closest) {
+	store->hit(prims, count, ray, closest);
+}
+
+inline bool occluded_leaf(const PrimitiveStore* store, const PrimRef* prims, int count, Ray& ray) {
+	return store->occluded(prims, count, ray);
+}
+
+inline void hit_packet_leaf(const PrimitiveStore* store, const PrimRef* prims, int count, RayPacket& packet, int mask) {
+	store->hit_packet(prims, count, packet, mask);
+}
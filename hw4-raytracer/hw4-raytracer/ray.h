@@ -1,6 +1,7 @@
 #pragma once
 
 #include <glm/glm.hpp>
+#include <cfloat>
 
 class Object;
 
@@ -12,6 +13,7 @@ public:
     Object* hit_obj; // no-hit indicator by default (NULL)
 
     Intersection(glm::vec3 hit_, glm::vec3 normal_ = glm::vec3(0.0f), Object* obj = nullptr) : hit(hit_), normal(normal_), hit_obj(obj) {};
+    Intersection() : Intersection(glm::vec3(0.0f)) {};
 };
 
 // for convenience
@@ -21,6 +23,65 @@ class Ray {
 public:
     glm::vec3 origin;
     glm::vec3 direction;
+    float t_max = FLT_MAX; // hits farther than this are not wanted (shrinks during closest-hit traversal)
 
     Ray(glm::vec3 orig, glm::vec3 dir) : origin(orig), direction(dir) {};
-};
\ No newline at end of file
+};
+
+// Up to PACKET_SIZE coherent rays (a PACKET_WIDTH x PACKET_HEIGHT pixel block) traced together.
+// Ray data is SoA so box tests can run over several rays per instruction.
+const int PACKET_WIDTH = 4;
+const int PACKET_HEIGHT = 4;
+const int PACKET_SIZE = PACKET_WIDTH * PACKET_HEIGHT;
+
+struct alignas(32) RayPacket {
+    float org[3][PACKET_SIZE];
+    float dir[3][PACKET_SIZE];
+    float inv_dir[3][PACKET_SIZE];
+    float t_max[PACKET_SIZE];           // per ray, shrinks as hits are found
+    Intersection hits[PACKET_SIZE];     // closest hit per ray (hit_obj NULL if none)
+    int count = 0;                      // rays in use, edge blocks can be partial
+    bool common_origin = false;         // all rays start at one point (camera rays): allows the frustum test
+    bool same_signs = false;            // every axis has one direction sign (and no zero component) across the packet
+    float inv_min[3], inv_max[3];       // range of inv_dir per axis, for the frustum test
+
+    void set_ray(int k, const Ray& r) {
+        for (int a = 0; a < 3; a++) {
+            org[a][k] = r.origin[a];
+            dir[a][k] = r.direction[a];
+        }
+        t_max[k] = r.t_max;
+        hits[k] = Intersection();
+    }
+    Ray get_ray(int k) const {
+        Ray r(glm::vec3(org[0][k], org[1][k], org[2][k]), glm::vec3(dir[0][k], dir[1][k], dir[2][k]));
+        r.t_max = t_max[k];
+        return r;
+    }
+    int full_mask() const { return (count >= 32) ? -1 : (1 << count) - 1; }
+
+    // call once all rays are set; unused lanes copy ray 0 so SIMD tests stay well defined
+    void prepare() {
+        for (int k = count; k < PACKET_SIZE; k++) {
+            for (int a = 0; a < 3; a++) {
+                org[a][k] = org[a][0];
+                dir[a][k] = dir[a][0];
+            }
+            t_max[k] = 0.0f;
+        }
+        common_origin = true;
+        same_signs = true;
+        for (int a = 0; a < 3; a++) {
+            inv_min[a] = FLT_MAX;
+            inv_max[a] = -FLT_MAX;
+            for (int k = 0; k < PACKET_SIZE; k++) {
+                inv_dir[a][k] = 1.0f / dir[a][k];
+                inv_min[a] = (inv_dir[a][k] < inv_min[a]) ? inv_dir[a][k] : inv_min[a];
+                inv_max[a] = (inv_dir[a][k] > inv_max[a]) ? inv_dir[a][k] : inv_max[a];
+                common_origin = common_origin && org[a][k] == org[a][0];
+            }
+            // an axis-parallel ray (inv_dir = inf) would put 0 * inf into the frustum bounds, so it opts out too
+            same_signs = same_signs && (inv_min[a] >= 0.0f || inv_max[a] < 0.0f) && inv_min[a] > -FLT_MAX && inv_max[a] < FLT_MAX;
+        }
+    }
+};
@@ -30,7 +30,7 @@ void rightmultiply(const glm::mat4& M, std::stack<glm::mat4>& transfstack)
 
 // Function to read the input data values
 // Use is optional, but should be very helpful in parsing.  
-bool readvals(std::stringstream& s, const int numvals, GLfloat* values)
+bool readvals(std::stringstream& s, const int numvals, float* values)
 {
     for (int i = 0; i < numvals; i++) {
         s >> values[i];
@@ -42,15 +42,71 @@ bool readvals(std::stringstream& s, const int numvals, GLfloat* values)
     return true;
 }
 
-Window* readfile(const char* filename)
+// Wraps the pending triangles into a Mesh instance placed by 'transform'.
+// Only referenced vertices are kept, and geometry identical to an earlier mesh reuses its
+// MeshData (and BVH), so repeated pushTransform/popTransform copies cost memory once.
+static Mesh* create_mesh(
+    const std::vector<glm::vec3>& vertices,
+    const std::vector<Triangle*>& pending,
+    const glm::mat4& transform,
+    std::vector<std::shared_ptr<MeshData>>& library,
+    const BVHBuildOptions& bvh_options,
+    glm::vec3 ambient, glm::vec3 diffuse, glm::vec3 specular, glm::vec3 emission, float shininess)
+{
+    std::vector<int> remap(vertices.size(), -1);
+    std::vector<glm::vec3> used_vertices;
+    std::vector<Triangle*> triangles;
+    for (Triangle* tri : pending) {
+        glm::vec3 idx = tri->get_indices();
+        bool known = true;
+        for (int k = 0; k < 3; k++) {
+            known = known && idx[k] >= 0.0f && idx[k] < static_cast<float>(vertices.size());
+        }
+        if (!known) {
+            std::cout << "[readfile] triangle " << idx[0] << " " << idx[1] << " " << idx[2]
+                << " refers to a vertex that is not there (" << vertices.size() << " read), skipped\n";
+            continue;
+        }
+        for (int k = 0; k < 3; k++) {
+            int v = static_cast<int>(idx[k]);
+            if (remap[v] == -1) {
+                remap[v] = static_cast<int>(used_vertices.size());
+                used_vertices.push_back(vertices[v]);
+            }
+            idx[k] = static_cast<float>(remap[v]);
+        }
+        triangles.push_back(new Triangle(idx, nullptr, tri->get_ambient(), tri->get_diffuse(),
+            tri->get_specular(), tri->get_emission(), tri->get_shininess()));
+    }
+
+    std::shared_ptr<MeshData> data = nullptr;
+    for (auto& known : library) {
+        if (known->matches(used_vertices, triangles)) {
+            data = known; // instance of existing geometry
+            break;
+        }
+    }
+    if (data == nullptr) {
+        data = std::make_shared<MeshData>(used_vertices, triangles, bvh_options);
+        library.push_back(data);
+    }
+    else {
+        for (Triangle* tri : triangles) {
+            delete tri;
+        }
+        std::cout << "[readfile] mesh instanced (" << data->triangle_count() << " triangles shared)\n";
+    }
+
+    return new Mesh(data, transform, ambient, diffuse, specular, emission, shininess);
+}
+
+Scene* readfile(const char* filename, Resolution& res)
 {
     std::string str, cmd;
     std::ifstream in;
     in.open(filename);
     if (in.is_open()) {
-        Window* window = new Window(2, 2, "raytracer"); // initialize with dummy values first
-        Scene* scene = new Scene();
-        window->attach_scene(scene);
+        Scene* scene = new Scene(); // no window here: the caller opens one (or not) at 'res'
 
         std::stack <glm::mat4> transfstack; // these are MODEL -> WORLD coordinates
         transfstack.push(glm::mat4(1.0f)); // push identity if root
@@ -58,7 +114,9 @@ Window* readfile(const char* filename)
         unsigned int maxverts = 0;
         unsigned int current_vert = 0; // when this value hits maxverts, store in scene, and reset
         std::vector<glm::vec3> vertices; // for new mesh
-        std::vector<Triangle*> triangles; // for new mesh
+        std::vector<Triangle*> triangles; // for new mesh (indices into 'vertices')
+        glm::mat4 triangles_transform(1.0f); // every triangle of one mesh shares its placement
+        std::vector<std::shared_ptr<MeshData>> mesh_library; // geometry already built, for instancing
 
         // object property states:
         // (FILE FORMAT MATTERS: very fragile)
@@ -77,8 +135,8 @@ Window* readfile(const char* filename)
                 std::stringstream s(str);
                 s >> cmd;
                 int i;
-                GLfloat values[10]; // Position and color for light, colors for others
-                // Up to 10 params for cameras.  
+                float values[12]; // Position and color for light, colors for others
+                // Up to 10 params for cameras, 11 for keyframes.  
                 bool validinput; // Validity of input 
 
                 // Process the light, add it to database.
@@ -111,13 +169,29 @@ Window* readfile(const char* filename)
                 else if (cmd == "tri") { // triangle idx based on vertices
                     // unlike vertices, these are cleared after every popTransform call
                     validinput = readvals(s, 3, values);
-                    if (validinput) {
-                        // not checking, but values[i] should be a valid vertex index <maxverts
+                    for (int k = 0; validinput && k < 3; k++) {
+                        validinput = values[k] >= 0.0f && values[k] < static_cast<float>(vertices.size())
+                            && values[k] == std::floor(values[k]);
+                    }
+                    if (!validinput) {
+                        std::cout << "not valid input for 'tri', expects whole vertex indices below " << vertices.size() << ": " << str << "\n";
+                    }
+                    else {
+                        // a transform change between triangles starts a new mesh
+                        if (triangles.size() > 0 && transfstack.top() != triangles_transform) {
+                            scene->register_object(create_mesh(vertices, triangles, triangles_transform, mesh_library, scene->get_bvh_options(),
+                                ambient, diffuse, specular, emission, shininess));
+                            for (Triangle* tri : triangles) {
+                                delete tri;
+                            }
+                            triangles.clear();
+                        }
+                        triangles_transform = transfstack.top();
+
+                        // indices checked above against the vertices read so far
                         Triangle* new_tri = new Triangle(
                             glm::vec3(values[0], values[1], values[2]),
-                            nullptr, // parent
-                            TRIANGLE,
-                            transfstack.top(),
+                            nullptr, // parent (assigned by create_mesh)
                             ambient,
                             diffuse,
                             specular,
@@ -202,10 +276,23 @@ Window* readfile(const char* filename)
                 else if (cmd == "size") { // window size
                     validinput = readvals(s, 2, values);
                     if (validinput) {
-                        window->set_size((int)values[0], (int)values[1]);
+                        res = Resolution((int)values[0], (int)values[1]);
+                        // affect main_cam as well
+                        Camera* main_cam = scene->get_main_camera();
+                        if (main_cam != NULL) {
+                            main_cam->set_width(res.w);
+                            main_cam->set_height(res.h);
+                        }
                         std::cout << "[from readfile] windowsize set to " << values[0] << ", " << values[1];
                     }
                 }
+                else if (cmd == "output") { // image file for offline renders
+                    std::string fname;
+                    s >> fname;
+                    if (!s.fail()) {
+                        scene->set_output_file(fname);
+                    }
+                }
                 else if (cmd == "camera") {
                     validinput = readvals(s, 10, values); // 10 values eye cen up fov
                     if (validinput) {
@@ -226,16 +313,63 @@ Window* readfile(const char* filename)
                             eyeinit,
                             upinit,
                             center,
-                            window->get_res().w,
-                            window->get_res().h,
+                            res.w,
+                            res.h,
                             fovy
                         );
 
-                        window->scene->register_camera(new_cam, true);
+                        scene->register_camera(new_cam, true);
                         std::cout << "camera_created, posx: " << new_cam->get_pos()[0];
                     }
                 }
 
+                // sequence renders: frame count, then keys at frame numbers (0-based) in any order
+                else if (cmd == "frames") {
+                    validinput = readvals(s, 1, values);
+                    if (validinput) {
+                        scene->get_sequence().set_frames(static_cast<int>(values[0]));
+                    }
+                }
+                else if (cmd == "keycamera") { // frame, then eye center up fov as for "camera"
+                    validinput = readvals(s, 11, values);
+                    if (validinput) {
+                        CameraKey key;
+                        key.frame = static_cast<int>(values[0]);
+                        key.eye = glm::vec3(values[1], values[2], values[3]);
+                        key.center = glm::vec3(values[4], values[5], values[6]);
+                        key.up = glm::vec3(values[7], values[8], values[9]); // made orthogonal per frame, after blending
+                        key.fov = values[10];
+                        scene->get_sequence().add_camera_key(key);
+                    }
+                }
+                else if (cmd == "keytransform") { // frame, translate xyz, rotate axis xyz + degrees, scale xyz
+                    validinput = readvals(s, 11, values);
+                    if (validinput) {
+                        // animates the object registered last: a sphere above, or the mesh the
+                        // last popTransform closed (pending triangles become their mesh first)
+                        if (vertices.size() > 0 && triangles.size() > 0) {
+                            scene->register_object(create_mesh(vertices, triangles, triangles_transform, mesh_library, scene->get_bvh_options(),
+                                ambient, diffuse, specular, emission, shininess));
+                            for (Triangle* tri : triangles) {
+                                delete tri;
+                            }
+                            triangles.clear();
+                        }
+                        TransformKey key;
+                        key.frame = static_cast<int>(values[0]);
+                        key.translate = glm::vec3(values[1], values[2], values[3]);
+                        key.axis = glm::vec3(values[4], values[5], values[6]);
+                        key.degrees = values[7];
+                        key.scale = glm::vec3(values[8], values[9], values[10]);
+                        if (scene->last_object() == nullptr) {
+                            std::cout << "keytransform before any object, skipped\n";
+                        }
+                        else {
+                            scene->get_sequence().add_transform_key(scene->last_object(), key);
+                        }
+                    }
+                }
+
                 // sphere is a separate object from a "Mesh" of triangles/vertices
                 else if (cmd == "sphere") {
                     validinput = readvals(s, 4, values); // (x,y,z) + radius
@@ -286,6 +420,84 @@ Window* readfile(const char* filename)
                     }
                 }
 
+                else if (cmd == "threads") { // render worker threads (0: all hardware threads)
+                    validinput = readvals(s, 1, values);
+                    if (validinput) {
+                        scene->set_render_threads(static_cast<int>(values[0]));
+                    }
+                }
+
+                else if (cmd == "bvhwidth") { // 2, 4 or 8 children per BVH node, for meshes read after this and the scene
+                    validinput = readvals(s, 1, values);
+                    if (validinput) {
+                        BVHBuildOptions opts = scene->get_bvh_options();
+                        opts.width = static_cast<int>(values[0]);
+                        scene->set_bvh_options(opts);
+                    }
+                }
+
+                else if (cmd == "bvhleafsize") { // most primitives per BVH leaf (the SAH picks up to this), for meshes read after this and the scene
+                    validinput = readvals(s, 1, values);
+                    if (validinput) {
+                        BVHBuildOptions opts = scene->get_bvh_options();
+                        opts.max_leaf_size = std::max(1, static_cast<int>(values[0]));
+                        scene->set_bvh_options(opts);
+                    }
+                }
+
+                else if (cmd == "bvhbuild") { // "sah" or "lbvh" (fast build for huge meshes), for meshes read after this and the scene
+                    std::string method;
+                    s >> method;
+                    if (!s.fail() && (method == "sah" || method == "lbvh")) {
+                        BVHBuildOptions opts = scene->get_bvh_options();
+                        opts.method = (method == "lbvh") ? BVH_BUILD_LBVH : BVH_BUILD_SAH;
+                        scene->set_bvh_options(opts);
+                    }
+                    else {
+                        std::cerr << "bvhbuild expects sah or lbvh\n";
+                    }
+                }
+
+                else if (cmd == "bvhlayout") { // node order in memory: "depthfirst", "veb" or "treelet", for meshes read after this and the scene
+                    std::string layout;
+                    s >> layout;
+                    BVHBuildOptions opts = scene->get_bvh_options();
+                    if (!s.fail() && (layout == "depthfirst" || layout == "veb" || layout == "treelet")) {
+                        opts.layout = (layout == "veb") ? BVH_LAYOUT_VEB : (layout == "treelet") ? BVH_LAYOUT_TREELET : BVH_LAYOUT_DEPTH_FIRST;
+                        scene->set_bvh_options(opts);
+                    }
+                    else {
+                        std::cerr << "bvhlayout expects depthfirst, veb or treelet\n";
+                    }
+                }
+
+                else if (cmd == "bvhhugepages") { // 1: big BVH node arrays on huge pages, for meshes read after this and the scene
+                    validinput = readvals(s, 1, values);
+                    if (validinput) {
+                        BVHBuildOptions opts = scene->get_bvh_options();
+                        opts.huge_pages = values[0] != 0.0f;
+                        scene->set_bvh_options(opts);
+                    }
+                }
+
+                else if (cmd == "bvhquantize") { // 1: compact 8-bit node boxes for meshes read after this (huge scenes)
+                    validinput = readvals(s, 1, values);
+                    if (validinput) {
+                        BVHBuildOptions opts = scene->get_bvh_options();
+                        opts.quantized = values[0] != 0.0f;
+                        scene->set_bvh_options(opts);
+                    }
+                }
+
+                else if (cmd == "bvhsplits") { // SBVH for meshes read after this: extra references allowed, as a fraction (0: off)
+                    validinput = readvals(s, 1, values);
+                    if (validinput) {
+                        BVHBuildOptions opts = scene->get_bvh_options();
+                        opts.spatial_split_budget = std::max(0.0f, values[0]);
+                        scene->set_bvh_options(opts);
+                    }
+                }
+
                 else if (cmd == "pushTransform") {
                     transfstack.push(transfstack.top());
                 }
@@ -297,18 +509,13 @@ Window* readfile(const char* filename)
                     else {
                         // create Mesh if there is one
                         if (vertices.size() > 0 && triangles.size() > 0) {
-                            Mesh* obj = new Mesh(
-                                vertices,
-                                triangles,
-                                transfstack.top(),
-                                ambient,
-                                diffuse,
-                                specular,
-                                emission,
-                                shininess
-                            );
+                            Mesh* obj = create_mesh(vertices, triangles, triangles_transform, mesh_library, scene->get_bvh_options(),
+                                ambient, diffuse, specular, emission, shininess);
                             scene->register_object(obj);
                         }
+                        for (Triangle* tri : triangles) {
+                            delete tri;
+                        }
                         triangles.clear();
                         transfstack.pop();
                     }
@@ -323,20 +530,15 @@ Window* readfile(const char* filename)
 
         // create Mesh if there is one (if no popTransform)
         if (vertices.size() > 0 && triangles.size() > 0) {
-            Mesh* obj = new Mesh(
-                vertices,
-                triangles,
-                transfstack.top(),
-                ambient,
-                diffuse,
-                specular,
-                emission,
-                shininess
-            );
+            Mesh* obj = create_mesh(vertices, triangles, triangles_transform, mesh_library, scene->get_bvh_options(),
+                ambient, diffuse, specular, emission, shininess);
             scene->register_object(obj);
         }
+        for (Triangle* tri : triangles) {
+            delete tri;
+        }
 
-        return window;
+        return scene;
     }
     else {
         std::cerr << "Unable to Open Input Data File " << filename << "\n";
@@ -0,0 +1,93 @@
+#include <algorithm>
+#include <iostream>
+
+#include "render_engine.h"
+
+RenderEngine::RenderEngine(int threads, int tile_size) {
+	this->threads = 1;
+	this->tile_size = 32;
+	set_threads(threads);
+	set_tile_size(tile_size);
+}
+
+RenderEngine::~RenderEngine() {
+	delete pool;
+}
+
+void RenderEngine::set_threads(int n) {
+	if (n <= 0) {
+		n = ThreadPool::default_threads();
+	}
+	if (n == threads && (pool != nullptr || n == 1)) {
+		return; // nothing to change
+	}
+	delete pool;
+	pool = nullptr;
+	threads = n;
+	if (threads > 1) {
+		// the calling thread also works while it waits, so spawn one less
+		pool = new ThreadPool(threads - 1);
+	}
+}
+
+void RenderEngine::set_tile_size(int s) {
+	if (s > 0) {
+		tile_size = s;
+	}
+	else {
+		std::cout << "Tile size not changed. Argument needs to be a positive integer.\n";
+	}
+}
+
+std::vector<Tile> RenderEngine::make_tiles(int width, int height, int align) {
+	std::vector<Tile> tiles;
+	align = std::max(1, align);
+	int tile_width = (tile_size + align - 1) / align * align;
+	for (int r = 0; r < height; r += tile_size) {
+		for (int c = 0; c < width; c += tile_width) {
+			tiles.push_back(Tile{ r, c, std::min(r + tile_size, height), std::min(c + tile_width, width) });
+		}
+	}
+	return tiles;
+}
+
+std::vector<Tile> RenderEngine::render(int width, int height, const TileFunc& shade_tile, int align) {
+	std::vector<Tile> tiles = make_tiles(width, height, align);
+
+	if (pool == nullptr) { // single threaded path, tiles in order
+		for (const Tile& t : tiles) {
+			shade_tile(t);
+		}
+		return tiles;
+	}
+
+	pool->parallel_for(static_cast<int>(tiles.size()), [&tiles, &shade_tile](int idx) {
+		shade_tile(tiles[idx]);
+	});
+	return tiles;
+}
+
+void RenderEngine::render_views(const std::vector<int>& widths, const std::vector<int>& heights, const std::vector<int>& aligns,
+	const ViewTileFunc& shade_tile) {
+	struct ViewTile {
+		int view;
+		Tile tile;
+	};
+	std::vector<ViewTile> work;
+	for (int v = 0; v < static_cast<int>(widths.size()); v++) {
+		for (const Tile& t : make_tiles(widths[v], heights[v], aligns[v])) {
+			work.push_back(ViewTile{ v, t });
+		}
+	}
+
+	if (pool == nullptr) {
+		for (const ViewTile& w : work) {
+			shade_tile(w.view, w.tile);
+		}
+		return;
+	}
+
+	pool->parallel_for(static_cast<int>(work.size()), [&work, &shade_tile](int idx) {
+		shade_tile(work[idx].view, work[idx].tile);
+	});
+}
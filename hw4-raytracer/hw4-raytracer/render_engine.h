@@ -0,0 +1,39 @@
+#pragma once
+
+#include <functional>
+#include <vector>
+#include "thread_pool.h"
+
+// rectangular block of pixels [row0, row1) x [col0, col1)
+struct Tile {
+	int row0, col0;
+	int row1, col1;
+};
+
+typedef std::function<void(const Tile&)> TileFunc;
+typedef std::function<void(int view, const Tile&)> ViewTileFunc;
+
+// Splits a frame into tiles and runs them on a work-stealing pool.
+// Every pixel is shaded by exactly one tile, so the output does not depend on the worker count.
+class RenderEngine {
+private:
+	ThreadPool* pool = nullptr; // not created when rendering on one thread
+	int threads;
+	int tile_size;
+
+public:
+	RenderEngine(int threads = 0, int tile_size = 32); // threads 0: one per hardware thread
+	~RenderEngine();
+
+	void set_threads(int n);
+	int get_threads() { return threads; }
+	void set_tile_size(int s);
+	int get_tile_size() { return tile_size; }
+	// tile columns are rounded up to a multiple of 'align' pixels for this frame only (the tile size
+	// stays as set), e.g. so tiles of a framebuffer never share a cache line
+	std::vector<Tile> make_tiles(int width, int height, int align = 1);
+	std::vector<Tile> render(int width, int height, const TileFunc& shade_tile, int align = 1); // returns the tiles it shaded
+	// several frames (views) at once: their tiles share one parallel loop, so views render concurrently
+	void render_views(const std::vector<int>& widths, const std::vector<int>& heights, const std::vector<int>& aligns,
+		const ViewTileFunc& shade_tile);
+};
@@ -1,7 +1,11 @@
+#include <algorithm>
 #include <iostream>
 
 #include "scene.h"
 
+// shadow rays start this far along the light direction so they don't hit their own surface
+static const float SHADOW_EPSILON = 1e-4f;
+
 ///* SCENE *///
 
 Scene::Scene(int sens) {
@@ -49,12 +53,16 @@ bool Scene::register_camera(Camera* cam, bool make_current) {
 		set_current_camera(size_before); // set as main
 		main_cam = size_before;
 	}
+	version++;
 	return true;
 }
 
 bool Scene::set_current_camera(int idx) {
 	if (idx < cameras.size()) {
-		main_cam = idx;
+		if (idx != main_cam) {
+			main_cam = idx;
+			version++;
+		}
 		return true;
 	}
 	return false; // and don't change
@@ -64,12 +72,50 @@ bool Scene::set_current_camera(int idx) {
 void Scene::register_object(Object* obj) {
 	if (obj != nullptr) {
 		objects.push_back(obj);
+		version++;
 	}
 }
 
+void Scene::add_object(Object* obj) {
+	if (obj == nullptr) {
+		return;
+	}
+	register_object(obj);
+	if (bvh != nullptr) {
+		bvh_edited = true;
+		if (bvh->insert(primitives.add(obj))) {
+			bvh_objects_version += obj->get_version(); // the tree is as current as it was before
+		}
+		// else the tree is one primitive short of the scene, update_bvh() rebuilds it
+	}
+}
+
+bool Scene::remove_object(Object* obj) {
+	auto it = std::find(objects.begin(), objects.end(), obj);
+	if (it == objects.end()) {
+		return false;
+	}
+	objects.erase(it);
+	version += obj->get_version() + 1; // its counter leaves the sum in get_version(), keep the total growing
+	sequence.remove_object(obj); // no more keys for it
+	PrimRef ref;
+	if (primitives.find(obj, ref)) {
+		if (bvh != nullptr) {
+			bvh_edited = true;
+			if (bvh->remove(ref)) {
+				bvh_objects_version -= obj->get_version();
+			}
+			// else the tree still holds its slot, one primitive more than the scene: update_bvh() rebuilds it
+		}
+		primitives.remove(ref);
+	}
+	return true;
+}
+
 void Scene::register_light(Light* light) {
 	if (light != nullptr) {
 		lights.push_back(light);
+		version++;
 	}
 }
 
@@ -95,6 +141,7 @@ int Scene::get_sensitivity() {
 void Scene::set_maxdepth(int depth) {
 	if (depth > 0) {
 		max_depth = depth;
+		version++;
 	}
 	else {
 		std::cout << "Depth not changed. Argument needs to be a positive integer.\n";
@@ -109,35 +156,176 @@ TransformType Scene::get_transform_type() {
 	return transop;
 }
 
-// using 2D image here, but flatten in main.cpp
-RGBImage Scene::raytrace() {
-	// Compute frame, load textures
+void Scene::set_render_threads(int n) {
+	engine.set_threads(n);
+}
+
+int Scene::get_render_threads() {
+	return engine.get_threads();
+}
+
+unsigned long long Scene::objects_version() {
+	unsigned long long v = 0;
+	for (Object* obj : objects) {
+		v += obj->get_version();
+	}
+	return v;
+}
+
+unsigned long long Scene::get_version() {
+	unsigned long long v = version;
+	for (Camera* cam : cameras) {
+		v += cam->get_version();
+	}
+	v += objects_version();
+	for (Light* light : lights) {
+		v += light->version;
+	}
+	return v;
+}
+
+std::vector<Tile> Scene::raytrace(Framebuffer& frame, int first_step, Framebuffer* target) {
+	// Compute frame straight into the caller's (reused) framebuffer
 	Camera* cam = get_main_camera();
-	RGBImage texture(cam->get_height(), std::vector<glm::vec3>(cam->get_width()));
-
-	for (int i = 0; i < cam->get_height(); i++) {
-		for (int j = 0; j < cam->get_width(); j++) {
-			// for all pixels
-			Ray ray = cam->ray_for_pixel(i, j); // generate ray
-			Intersection hit = closest_intersection(ray);  // get closest hit (if any)
-			if (hit.hit_obj != nullptr) {
-				texture[i][j] = color_at(hit); // hit: color with object properties
-			} else {
-				texture[i][j] = glm::vec3(0.0f); // black; no hit
-			}
+	frame.resize(cam->get_width(), cam->get_height()); // a new size clears the frame, so it is traced again
+	unsigned long long current = get_version();
+	int step = std::max(1, first_step);
+	int done_step = 0; // block size of the samples already in the frame (0: none usable)
+	if (is_current(frame)) {
+		return std::vector<Tile>(); // nothing changed since this frame was traced
+	}
+	if (frame.get_content_version() == current) {
+		// same scene, coarser than wanted: refine
+		done_step = frame.get_content_step();
+		step = std::min(step, done_step / 2);
+	}
+	else {
+		// a change cancels any refinement in progress and starts over at the coarsest pass
+		while (step & (step - 1)) { // power of two, so every pass holds the samples of the one before
+			step &= step - 1;
+		}
+	}
+	// a full pass reads nothing back, so it can go straight to the target
+	Framebuffer* out = (step == 1 && target != nullptr) ? target : &frame;
+
+	// each tile writes only its own pixels, so workers never touch the same element;
+	// tiles a whole number of cache lines wide keep them off each other's lines too
+	std::vector<Tile> shaded = engine.render(cam->get_width(), cam->get_height(), [this, cam, out, step, done_step](const Tile& tile) {
+		TileView view = out->tile(tile);
+		if (step == 1) {
+			shade_tile(tile, view, cam);
+		}
+		else {
+			shade_tile_sparse(tile, view, cam, step, done_step);
+		}
+	}, out->min_tile_width());
+	frame.set_content_version(current, step);
+	return shaded;
+}
+
+bool Scene::is_current(const Framebuffer& frame) {
+	Camera* cam = get_main_camera();
+	return frame.get_width() == cam->get_width() && frame.get_height() == cam->get_height()
+		&& frame.get_content_version() == get_version() && frame.get_content_step() <= 1;
+}
+
+bool Scene::raytrace_views(const std::vector<int>& cam_ids, const std::vector<Framebuffer*>& frames) {
+	if (frames.size() != cam_ids.size()) {
+		std::cout << "[Scene] raytrace_views: " << cam_ids.size() << " cameras for " << frames.size() << " frames, nothing traced\n";
+		return false;
+	}
+	for (int id : cam_ids) {
+		if (id < 0 || id >= static_cast<int>(cameras.size())) {
+			std::cout << "[Scene] raytrace_views: no camera " << id << ", nothing traced\n";
+			return false;
 		}
 	}
+	std::vector<int> widths, heights, aligns;
+	for (size_t v = 0; v < cam_ids.size(); v++) {
+		Camera* cam = cameras[cam_ids[v]];
+		frames[v]->resize(cam->get_width(), cam->get_height());
+		frames[v]->set_content_version(0); // not the main camera's view: raytrace() must not take it as current
+		widths.push_back(cam->get_width());
+		heights.push_back(cam->get_height());
+		aligns.push_back(frames[v]->min_tile_width());
+	}
 
-	// for each pixel, compute intersections, then compute colors
+	engine.render_views(widths, heights, aligns, [this, &cam_ids, &frames](int v, const Tile& tile) {
+		TileView view = frames[v]->tile(tile);
+		shade_tile(tile, view, cameras[cam_ids[v]]);
+	});
+	return true;
+}
 
-	return texture;
+void Scene::shade_tile(const Tile& tile, TileView& view, Camera* cam) {
+	// primary rays go out in small pixel blocks that share most of their BVH path
+	RayPacket packet;
+	for (int r0 = tile.row0; r0 < tile.row1; r0 += PACKET_HEIGHT) {
+		for (int c0 = tile.col0; c0 < tile.col1; c0 += PACKET_WIDTH) {
+			int r1 = std::min(r0 + PACKET_HEIGHT, tile.row1);
+			int c1 = std::min(c0 + PACKET_WIDTH, tile.col1);
+			cam->rays_for_block(r0, c0, r1, c1, packet); // generate rays
+			closest_intersection(packet); // get closest hits (if any)
+
+			int k = 0;
+			for (int i = r0; i < r1; i++) {
+				for (int j = c0; j < c1; j++, k++) {
+					Intersection& hit = packet.hits[k];
+					if (hit.hit_obj != nullptr) {
+						view.write(i, j, color_at(hit, cam)); // hit: color with object properties
+					} else {
+						view.write(i, j, glm::vec3(0.0f)); // black; no hit
+					}
+				}
+			}
+		}
+	}
+}
+
+void Scene::shade_tile_sparse(const Tile& tile, TileView& view, Camera* cam, int step, int done_step) {
+	// samples sit on a grid anchored at the tile corner, so each pass's blocks stay inside the tile
+	for (int i = tile.row0; i < tile.row1; i += step) {
+		for (int j = tile.col0; j < tile.col1; j += step) {
+			int di = i - tile.row0, dj = j - tile.col0;
+			glm::vec3 color;
+			if (done_step > 0 && di % done_step == 0 && dj % done_step == 0) {
+				color = view.fb->read(i, j); // traced by an earlier pass
+			}
+			else {
+				Ray ray = cam->ray_for_pixel(i, j);
+				Intersection hit = closest_intersection(ray);
+				color = (hit.hit_obj != nullptr) ? color_at(hit, cam) : glm::vec3(0.0f);
+			}
+			// the sample stands in for its whole block until a finer pass gets there
+			int i1 = std::min(i + step, tile.row1);
+			int j1 = std::min(j + step, tile.col1);
+			for (int bi = i; bi < i1; bi++) {
+				for (int bj = j; bj < j1; bj++) {
+					view.write(bi, bj, color);
+				}
+			}
+		}
+	}
 }
 
 Intersection Scene::closest_intersection(Ray& ray) {
+	if (bvh == nullptr) {
+		return Intersection(); // empty scene
+	}
 	return bvh->locate(ray);
 }
 
-glm::vec3 Scene::color_at(Intersection& inter) {
+void Scene::closest_intersection(RayPacket& packet) {
+	if (bvh != nullptr) {
+		bvh->locate_packet(packet, packet.full_mask());
+	}
+}
+
+bool Scene::occluded(Ray& ray, float tmax) {
+	return bvh != nullptr && bvh->occluded(ray, tmax);
+}
+
+glm::vec3 Scene::color_at(Intersection& inter, Camera* cam) {
 	// assumes hit is NOT NULL already
 	glm::vec3 ambient = inter.hit_obj->get_ambient();
 	glm::vec3 diffuse = inter.hit_obj->get_diffuse();
@@ -147,16 +335,17 @@ glm::vec3 Scene::color_at(Intersection& inter) {
 
 	// Compute the halfway vector between the light direction and the view direction
 
-	Camera* cam = get_main_camera();
 	glm::vec3 final_color = ambient + emission;
 	// std::cout << "FINAL_LIGHT: " << final_color.x << ", " << final_color.y << ", " << final_color.z << "\n";
 
 	// compute intersection color using all lights 
 	for (const Light* light : lights) {
 		glm::vec3 light_dir(0.0f);
+		float light_dist = FLT_MAX; // directional lights are infinitely far away
 
 		if (light->type == POINT) {
 			light_dir = glm::normalize(light->posdir - inter.hit); // normal must be reverrsed
+			light_dist = glm::length(light->posdir - inter.hit);
 		}
 		else if (light->type == DIRECTIONAL) {
 			light_dir = glm::normalize(light->posdir);
@@ -165,10 +354,9 @@ glm::vec3 Scene::color_at(Intersection& inter) {
 		glm::vec3 view_dir = glm::normalize(cam->get_pos() - inter.hit);
 		glm::vec3 halfvec = glm::normalize(light_dir + view_dir);
 
-		Ray shadow_ray(inter.hit + (light_dir * 1e-6f), light_dir); // hit + [small step] for numerical stability
-		Intersection shadow_inter = closest_intersection(shadow_ray);
+		Ray shadow_ray(inter.hit + (light_dir * SHADOW_EPSILON), light_dir); // hit + [small step] for numerical stability
 		
-		if (shadow_inter.hit_obj == nullptr) { // not shadow
+		if (!occluded(shadow_ray, light_dist - SHADOW_EPSILON)) { // not shadow, blockers behind a point light don't count
 			glm::vec3 light_attribution = compute_color(
 				light_dir,
 				light->rgb,
@@ -183,7 +371,7 @@ glm::vec3 Scene::color_at(Intersection& inter) {
 		}
 	}
 
-	return final_color * 255.0f;
+	return final_color; // linear, 1.0 is full intensity
 }
 
 glm::vec3 Scene::compute_color(
@@ -211,10 +399,97 @@ glm::vec3 Scene::compute_color(
 // best to call this when all objects are read 
 void Scene::construct_bvh() {
 	// create full bvh based on the objects that we currently have
+	version++;
+	delete bvh;
+	bvh = nullptr;
+	bvh_edited = false;
+	bvh_objects_version = objects_version();
+	primitives.clear();
 	if (objects.size() < 1) {
-		bvh = nullptr;
 		return; // nothing to process
 	}
 	
-	bvh = new BVH<Object*>(objects);
+	// leaves can hold a few objects: the SAH weighs each one by its intersect_cost(), so spheres
+	// share leaves while a mesh, which costs a whole sub-traversal, mostly gets its own
+	BVHBuildOptions opts = bvh_options;
+	opts.spatial_split_budget = 0.0f; // instances are moved, inserted and removed, which needs one reference each
+	opts.quantized = false; // and refit, which needs the float nodes
+	std::vector<PrimRef> refs;
+	refs.reserve(objects.size());
+	for (Object* obj : objects) {
+		refs.push_back(primitives.add(obj));
+	}
+	bvh = new BVH<PrimRef>(refs, opts, &primitives);
+	bvh->print_summary("scene");
+}
+
+void Scene::update_bvh() {
+	// mesh BVHs are in object space, so a moved instance only changes the scene level
+	unsigned long long current = objects_version();
+	bool edited = bvh_edited;
+	bvh_edited = false;
+	if (bvh != nullptr && current == bvh_objects_version && !edited) {
+		return;
+	}
+	if (bvh == nullptr || bvh->prim_count() != static_cast<int>(objects.size())) {
+		construct_bvh(); // objects registered: the tree doesn't know them
+		return;
+	}
+
+	if (current != bvh_objects_version) {
+		primitives.refresh(); // the leaves test the copies
+		bvh->refit();
+		bvh_objects_version = current;
+	}
+	if (edited) {
+		bvh->finish_updates();
+	}
+	float cost = bvh->sah_cost();
+	if (cost > BVH_REFIT_REBUILD_RATIO * bvh->get_build_sah()) {
+		std::cout << "[BVH] scene: refit SAH cost " << cost << " vs " << bvh->get_build_sah() << " when built, rebuilding\n";
+		construct_bvh();
+	}
+}
+
+void Scene::set_bvh_layout(BVHNodeLayout layout) {
+	bvh_options.layout = layout;
+	if (bvh != nullptr) {
+		bvh->relayout(layout);
+	}
+	std::vector<MeshData*> seen; // instances share their MeshData, reorder each once
+	for (Object* obj : objects) {
+		Mesh* mesh = dynamic_cast<Mesh*>(obj);
+		if (mesh == nullptr) {
+			continue;
+		}
+		MeshData* data = mesh->get_data().get();
+		if (std::find(seen.begin(), seen.end(), data) != seen.end()) {
+			continue;
+		}
+		seen.push_back(data);
+		data->get_bvh()->relayout(layout);
+	}
+}
+
+void Scene::print_traversal_stats() {
+	if (bvh == nullptr) {
+		return;
+	}
+	bvh->print_traversal_stats("scene");
+	bvh->reset_traversal_stats();
+
+	std::vector<MeshData*> seen; // instances share their MeshData, print each once
+	for (Object* obj : objects) {
+		Mesh* mesh = dynamic_cast<Mesh*>(obj);
+		if (mesh == nullptr) {
+			continue;
+		}
+		MeshData* data = mesh->get_data().get();
+		if (std::find(seen.begin(), seen.end(), data) != seen.end()) {
+			continue;
+		}
+		seen.push_back(data);
+		data->get_bvh()->print_traversal_stats("mesh");
+		data->get_bvh()->reset_traversal_stats();
+	}
 }
\ No newline at end of file
@@ -1,18 +1,20 @@
 #pragma once
 
-#include <glad/glad.h>
-#include <GLFW/glfw3.h>	
 #include <glm/glm.hpp>	
 #include <vector>
 #include <stack>
+#include <string>
 #include "object.h"
 #include "light.h"
 #include "camera.h"
 #include "enums.h"
 #include "bvh.h"
+#include "primitives.h"
+#include "render_engine.h"
+#include "framebuffer.h"
+#include "sequence.h"
 
 typedef void (*DisplayFunc)();
-typedef std::vector<std::vector<glm::vec3>> RGBImage; // the image/frame to be displayed
 
 enum TransformType {
 	ROTATE,
@@ -22,14 +24,24 @@ enum TransformType {
 
 class Scene {
 private:
-	BVH<Object*>* bvh = NULL;
+	BVH<PrimRef>* bvh = NULL;
 	std::vector<Object*> objects; // collect all objects, but then use BVH after processing
+	PrimitiveStore primitives; // the objects' copies the scene BVH's leaves index into, refreshed by update_bvh()
 	std::vector<Light*>   lights;
 	std::vector<Camera*> cameras;
-	int main_cam; // index of the current camera to view (for potential extension, but will only use one camera)
+	int main_cam = 0; // index of the current camera to view (for potential extension, but will only use one camera)
 	int cam_sensitivity; // rather than have this intrinsic to the camera, do for all
 	int max_depth;
 	TransformType transop = ROTATE;
+	RenderEngine engine; // tiles + worker threads for raytrace()
+	BVHBuildOptions bvh_options; // scene BVH and meshes created from here on
+	std::string output_file; // from the scene file's "output", for offline renders
+	Sequence sequence; // keyframes from the scene file, empty unless it has "frames"
+	unsigned long long bvh_objects_version = 0; // objects_version() when the BVH was built or refit
+	bool bvh_edited = false; // objects inserted/removed in place since the last update_bvh()
+	unsigned long long version = 1; // scene-level changes (objects/lights/cameras added, camera switch, depth, BVH)
+	void shade_tile(const Tile& tile, TileView& view, Camera* cam); // every pixel, in ray packets
+	void shade_tile_sparse(const Tile& tile, TileView& view, Camera* cam, int step, int done_step); // preview pass
 	glm::vec3 compute_color(
 		glm::vec3 lightdir,
 		glm::vec3 lightcolor,
@@ -49,6 +61,11 @@ public:
 	Camera* get_camera(int cam_idx); // possible extension; not implemented
 	bool register_camera(Camera* cam, bool make_current = true);
 	void register_object(Object* obj);
+	// For editors streaming objects in and out: unlike register_object, these also update an
+	// existing scene BVH in place (no rebuild). remove_object gives ownership back to the caller.
+	// Not while a frame is being traced; call update_bvh() before the next one.
+	void add_object(Object* obj);
+	bool remove_object(Object* obj); // false if obj is not in the scene
 	void register_light(Light* light);
 	bool set_current_camera(int idx);
 	void transform_sensitivity_up();
@@ -56,15 +73,54 @@ public:
 	void set_sensitivity(int sens_to);
 	int get_sensitivity();
 	void set_maxdepth(int d);
+	void set_render_threads(int n); // 0: one per hardware thread, 1: single threaded
+	int get_render_threads();
+	void set_render_tile_size(int s) { engine.set_tile_size(s); }
+	void set_bvh_options(BVHBuildOptions opts) { bvh_options = opts; }
+	BVHBuildOptions get_bvh_options() { return bvh_options; }
+	void set_output_file(const std::string& fname) { output_file = fname; }
+	std::string get_output_file() { return output_file; }
 	void set_transform_type(TransformType t);
 	TransformType get_transform_type();
-	RGBImage raytrace();
+	// Changes whenever the rendered image could: scene-level edits plus every camera, object and light counter.
+	// Counters only grow, and remove_object() moves the removed object's counter into the scene-level one,
+	// so the total never repeats: equal versions mean nothing changed.
+	unsigned long long get_version();
+	void mark_dirty() { version++; } // for changes made behind the setters' back
+	// Sized to the main camera; returns the tiles shaded (none if 'frame' already shows the current state).
+	// first_step > 1 makes it progressive: the first call after a change traces one pixel per
+	// first_step^2 block and fills the block with it, each further call halves the block size
+	// (reusing the samples already traced) and the last pass traces every pixel, as first_step 1 does.
+	// With a target (same size and format as 'frame', e.g. a view over mapped GPU memory), a pass over
+	// every pixel is written there instead and 'frame' only records the version; progressive passes
+	// still go to 'frame', they read the samples of the pass before. frame.get_content_step() is 1
+	// after a call that wrote to the target.
+	std::vector<Tile> raytrace(Framebuffer& frame, int first_step = 1, Framebuffer* target = nullptr);
+	bool is_current(const Framebuffer& frame); // shows the current state at full resolution: raytrace() would trace nothing
+	// Batch render: camera cam_ids[v] into *frames[v], each sized to its camera. The views share
+	// this scene and its BVH and their tiles run on the engine together. Always traces every view;
+	// false (and nothing traced) if an id is not a camera of the scene or the counts differ.
+	bool raytrace_views(const std::vector<int>& cam_ids, const std::vector<Framebuffer*>& frames);
 	Intersection closest_intersection(Ray& ray);
-	glm::vec3 color_at(Intersection& hit);
+	void closest_intersection(RayPacket& packet); // fills packet.hits
+	bool occluded(Ray& ray, float tmax); // anything on the ray before tmax?
+	glm::vec3 color_at(Intersection& hit, Camera* cam); // seen from cam (specular highlights depend on it)
 	void construct_bvh();
 	void print_bvh() {
 		bvh->display();
 	};
+	// after objects moved: refits the scene BVH, or rebuilds it when objects were registered or the
+	// tree's SAH cost degraded past BVH_REFIT_REBUILD_RATIO; nothing if no object changed.
+	// Also finishes the in-place edits of add_object/remove_object.
+	void update_bvh();
+	unsigned long long objects_version(); // sum of the objects' counters
+	Sequence& get_sequence() { return sequence; }
+	Object* last_object() { return objects.empty() ? nullptr : objects.back(); }
+	void print_traversal_stats(); // scene BVH, then every distinct mesh BVH; counters are reset after printing
+	void set_bvh_layout(BVHNodeLayout layout); // reorders the scene BVH and every mesh BVH in memory
+	int how_many_cameras() {
+		return static_cast<int>(cameras.size());
+	};
 	int how_many_objects() {
 		return static_cast<int>(objects.size());
 	};
@@ -0,0 +1,85 @@
+#include <algorithm>
+
+#include "sequence.h"
+#include "scene.h"
+#include "transform.h"
+
+// index of the last key at or before 'frame' (0 if none) and the blend towards the next one
+template <typename Key>
+static int find_keys(const std::vector<Key>& keys, int frame, float& t) {
+	int k = 0;
+	while (k + 1 < static_cast<int>(keys.size()) && keys[k + 1].frame <= frame) {
+		k++;
+	}
+	t = 0.0f;
+	if (k + 1 < static_cast<int>(keys.size()) && frame > keys[k].frame) {
+		t = static_cast<float>(frame - keys[k].frame) / static_cast<float>(keys[k + 1].frame - keys[k].frame);
+	}
+	return k;
+}
+
+template <typename Key>
+static void insert_sorted(std::vector<Key>& keys, const Key& key) {
+	auto it = std::find_if(keys.begin(), keys.end(), [&key](const Key& k) { return k.frame >= key.frame; });
+	if (it != keys.end() && it->frame == key.frame) {
+		*it = key; // same frame: the later key wins
+	}
+	else {
+		keys.insert(it, key);
+	}
+}
+
+void Sequence::add_camera_key(const CameraKey& key) {
+	insert_sorted(camera_keys, key);
+}
+
+void Sequence::add_transform_key(Object* obj, const TransformKey& key) {
+	if (obj == nullptr) {
+		return;
+	}
+	auto track = std::find_if(tracks.begin(), tracks.end(), [obj](const ObjectTrack& t) { return t.obj == obj; });
+	if (track == tracks.end()) {
+		tracks.push_back(ObjectTrack{ obj, obj->get_transform(), std::vector<TransformKey>() });
+		track = tracks.end() - 1;
+	}
+	insert_sorted(track->keys, key);
+}
+
+void Sequence::remove_object(Object* obj) {
+	tracks.erase(std::remove_if(tracks.begin(), tracks.end(), [obj](const ObjectTrack& t) { return t.obj == obj; }), tracks.end());
+}
+
+void Sequence::apply(Scene* scene, int frame) {
+	float t;
+	Camera* cam = scene->get_main_camera();
+	if (cam != nullptr && !camera_keys.empty()) {
+		int k = find_keys(camera_keys, frame, t);
+		const CameraKey& a = camera_keys[k];
+		const CameraKey& b = camera_keys[std::min(k + 1, static_cast<int>(camera_keys.size()) - 1)];
+		glm::vec3 eye = glm::mix(a.eye, b.eye, t);
+		glm::vec3 center = glm::mix(a.center, b.center, t);
+		cam->set_pos(eye);
+		cam->set_center(center);
+		cam->set_up(Transform::upvector(glm::mix(a.up, b.up, t), center - eye));
+		cam->set_fov(glm::mix(a.fov, b.fov, t));
+	}
+
+	for (ObjectTrack& track : tracks) {
+		int k = find_keys(track.keys, frame, t);
+		const TransformKey& a = track.keys[k];
+		const TransformKey& b = track.keys[std::min(k + 1, static_cast<int>(track.keys.size()) - 1)];
+		glm::vec3 translate = glm::mix(a.translate, b.translate, t);
+		glm::vec3 scale = glm::mix(a.scale, b.scale, t);
+		glm::vec3 axis = glm::mix(a.axis, b.axis, t); // keys usually share one axis; otherwise this is a rough blend
+		glm::mat4 rotate(1.0f);
+		if (glm::length(axis) > 0.0f) {
+			rotate = glm::mat4(Transform::axis_rotation(glm::mix(a.degrees, b.degrees, t), glm::normalize(axis)));
+		}
+		glm::mat4 key = Transform::translate(translate.x, translate.y, translate.z) * rotate
+			* Transform::scale(scale.x, scale.y, scale.z);
+		glm::mat4 placed = key * track.base;
+		if (placed != track.obj->get_transform()) { // unchanged objects keep their version (and the BVH)
+			track.obj->set_transform(placed);
+		}
+	}
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <glm/glm.hpp>
+#include <vector>
+#include "camera.h"
+#include "object.h"
+
+class Scene;
+
+// main camera placement at one frame
+struct CameraKey {
+	int frame;
+	glm::vec3 eye;
+	glm::vec3 center;
+	glm::vec3 up; // as given, only roughly up: apply() makes the blended one orthogonal to the view
+	float fov;
+};
+
+// extra placement of one object at one frame: translate * rotate * scale, applied on top of
+// the transform the object had when it was read (so a rotation spins it around the world origin)
+struct TransformKey {
+	int frame;
+	glm::vec3 translate;
+	glm::vec3 axis;
+	float degrees;
+	glm::vec3 scale;
+};
+
+// Keyframed animation for sequence renders. Values between keys are interpolated linearly,
+// before the first key and after the last one they hold.
+// apply() only goes through the Camera / Object setters, so the scene's version counters
+// tell what actually changed from one frame to the next.
+class Sequence {
+private:
+	struct ObjectTrack {
+		Object* obj;
+		glm::mat4 base; // transform from the scene file
+		std::vector<TransformKey> keys; // sorted by frame
+	};
+
+	int frames = 0; // 0: no sequence, render a single image
+	std::vector<CameraKey> camera_keys; // sorted by frame
+	std::vector<ObjectTrack> tracks;
+
+public:
+	void set_frames(int n) { frames = (n > 0) ? n : 0; }
+	int get_frames() const { return frames; }
+	bool has_transform_keys() const { return !tracks.empty(); }
+
+	void add_camera_key(const CameraKey& key);
+	void add_transform_key(Object* obj, const TransformKey& key);
+	void remove_object(Object* obj); // drops its keys, for objects taken out of the scene
+	void apply(Scene* scene, int frame); // moves the main camera and the animated objects to 'frame'
+};
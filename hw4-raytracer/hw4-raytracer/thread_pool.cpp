@@ -0,0 +1,143 @@
+#include "thread_pool.h"
+
+// index of the worker running on this thread (-1 for threads outside any pool)
+static thread_local int worker_index = -1;
+static thread_local const ThreadPool* worker_pool = nullptr;
+
+ThreadPool::ThreadPool(int threads) {
+	if (threads <= 0) {
+		threads = default_threads();
+	}
+	for (int i = 0; i <= threads; i++) { // the extra queue takes submissions from outside threads
+		queues.push_back(new WorkQueue());
+	}
+	for (int i = 0; i < threads; i++) {
+		workers.emplace_back(&ThreadPool::worker_loop, this, i);
+	}
+}
+
+ThreadPool::~ThreadPool() {
+	{
+		std::lock_guard<std::mutex> guard(sleep_lock);
+		stopping = true;
+	}
+	wake.notify_all();
+	for (auto& w : workers) {
+		w.join();
+	}
+	for (auto& q : queues) {
+		delete q;
+	}
+}
+
+int ThreadPool::default_threads() {
+	unsigned hw = std::thread::hardware_concurrency();
+	return (hw == 0) ? 1 : static_cast<int>(hw);
+}
+
+ThreadPool& ThreadPool::shared() {
+	static ThreadPool pool;
+	return pool;
+}
+
+int ThreadPool::current_queue() {
+	if (worker_pool == this && worker_index >= 0) {
+		return worker_index;
+	}
+	return static_cast<int>(queues.size()) - 1;
+}
+
+void ThreadPool::submit(std::function<void()> fn, TaskGroup& group) {
+	group.pending.fetch_add(1, std::memory_order_relaxed);
+	WorkQueue* q = queues[current_queue()];
+	{
+		std::lock_guard<std::mutex> guard(q->lock);
+		q->tasks.push_back(Task{ std::move(fn), &group });
+	}
+	queued.fetch_add(1, std::memory_order_release);
+	{
+		// taking the lock orders this notify after a worker's emptiness check
+		std::lock_guard<std::mutex> guard(sleep_lock);
+	}
+	wake.notify_one();
+}
+
+bool ThreadPool::pop_task(int idx, Task& out) {
+	int n = static_cast<int>(queues.size());
+	{
+		WorkQueue* own = queues[idx];
+		std::lock_guard<std::mutex> guard(own->lock);
+		if (!own->tasks.empty()) {
+			out = std::move(own->tasks.back()); // newest first: its data is still in cache
+			own->tasks.pop_back();
+			queued.fetch_sub(1, std::memory_order_relaxed);
+			return true;
+		}
+	}
+	for (int k = 1; k < n; k++) { // steal the oldest task from someone else
+		WorkQueue* victim = queues[(idx + k) % n];
+		std::lock_guard<std::mutex> guard(victim->lock);
+		if (!victim->tasks.empty()) {
+			out = std::move(victim->tasks.front());
+			victim->tasks.pop_front();
+			queued.fetch_sub(1, std::memory_order_relaxed);
+			return true;
+		}
+	}
+	return false;
+}
+
+void ThreadPool::run_task(Task& task) {
+	try {
+		task.fn();
+	}
+	catch (...) {
+		// keep the worker alive; the group's waiter gets the exception
+		std::lock_guard<std::mutex> guard(task.group->error_lock);
+		if (!task.group->error) {
+			task.group->error = std::current_exception();
+		}
+	}
+	task.group->pending.fetch_sub(1, std::memory_order_acq_rel);
+}
+
+void ThreadPool::worker_loop(int idx) {
+	worker_index = idx;
+	worker_pool = this;
+	Task task;
+	while (true) {
+		if (pop_task(idx, task)) {
+			run_task(task);
+			continue;
+		}
+		std::unique_lock<std::mutex> guard(sleep_lock);
+		wake.wait(guard, [this]() { return stopping || queued.load(std::memory_order_acquire) > 0; });
+		if (stopping && queued.load() == 0) {
+			return;
+		}
+	}
+}
+
+void ThreadPool::wait(TaskGroup& group) {
+	int idx = current_queue();
+	Task task;
+	while (!group.done()) {
+		if (pop_task(idx, task)) {
+			run_task(task);
+		}
+		else {
+			std::this_thread::yield(); // remaining tasks are already running elsewhere
+		}
+	}
+	if (group.error) {
+		std::rethrow_exception(group.error);
+	}
+}
+
+void ThreadPool::parallel_for(int count, const std::function<void(int)>& body) {
+	TaskGroup group;
+	for (int i = 0; i < count; i++) {
+		submit([&body, i]() { body(i); }, group);
+	}
+	wait(group);
+}
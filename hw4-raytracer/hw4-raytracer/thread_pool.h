@@ -0,0 +1,57 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// counts the outstanding tasks of one batch, so a caller can wait on just its own work
+class TaskGroup {
+public:
+	std::atomic<int> pending{ 0 };
+	std::mutex error_lock;
+	std::exception_ptr error; // first exception thrown by a task, rethrown by ThreadPool::wait
+	bool done() const { return pending.load(std::memory_order_acquire) == 0; }
+};
+
+// Work-stealing thread pool: every worker owns a deque of tasks, pops its own work LIFO
+// (cache-warm) and steals FIFO from the others when it runs dry.
+class ThreadPool {
+private:
+	struct Task {
+		std::function<void()> fn;
+		TaskGroup* group;
+	};
+	struct WorkQueue {
+		std::mutex lock;
+		std::deque<Task> tasks;
+	};
+
+	std::vector<std::thread> workers;
+	std::vector<WorkQueue*> queues; // one per worker, plus one shared by outside threads (last)
+	std::atomic<int> queued{ 0 };   // tasks waiting in any queue
+	std::mutex sleep_lock;
+	std::condition_variable wake;
+	bool stopping = false;
+
+	void worker_loop(int idx);
+	bool pop_task(int idx, Task& out); // own queue first, then steal
+	void run_task(Task& task);
+	int current_queue(); // queue index of the calling thread
+
+public:
+	ThreadPool(int threads = 0); // 0: one worker per hardware thread
+	~ThreadPool();
+
+	int size() const { return static_cast<int>(workers.size()); }
+	void submit(std::function<void()> fn, TaskGroup& group);
+	void wait(TaskGroup& group); // the caller helps run tasks until the group is done, then rethrows a task's exception
+	void parallel_for(int count, const std::function<void(int)>& body); // blocks until body(0..count-1) ran
+
+	static int default_threads();
+	static ThreadPool& shared(); // process-wide pool for one-off parallel work (e.g. BVH builds)
+};
@@ -66,6 +66,10 @@ void Window::poll_events() {
 	glfwPollEvents();
 }
 
+void Window::wait_events() {
+	glfwWaitEvents();
+}
+
 void Window::make_context_current() {
 	glfwMakeContextCurrent(this->window);
 }
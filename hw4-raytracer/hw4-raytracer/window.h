@@ -6,11 +6,6 @@
 
 #include "scene.h"
 
-struct Resolution {
-	int w, h;
-	Resolution(int w_, int h_) : w(w_), h(h_) {}
-};
-
 // mostly a wrapper class for GLFWwindow and other GLFW aspects
 class Window {
 public:
@@ -35,6 +30,7 @@ public:
 	GLFWframebuffersizefun set_framebuffersize_callback(GLFWframebuffersizefun callback_func);
 	void swap_buffers();
 	void poll_events(); // for this window context
+	void wait_events(); // sleeps until input (or a resize/refresh) arrives
 	void make_context_current();
 	// void set_display_func(DisplayFunc f); // moved responsibility to Scene
 	void attach_scene(Scene* scene);